@@ -21,6 +21,12 @@ AppConfig::AppConfig() {
   max_offset = 10000;
   max_limit  = 10000;
   max_words  = 10;
+  max_count  = 1000000;
+  worker_count = 8;
+  queue_size   = 1024;
+  flush_interval = 1000;
+  cache_size     = 1000;
+  search_threads = 1;
 }
 
 
@@ -23,11 +23,17 @@ public:
 
   bool daemon;
   unsigned short port;
+  unsigned int worker_count;
+  unsigned int queue_size;
+  unsigned int flush_interval;
+  unsigned int cache_size;
+  unsigned int search_threads;
   unsigned int max_document_length;
 
   unsigned int max_offset;
   unsigned int max_limit;
   unsigned int max_words;
+  unsigned int max_count;
 
   bool load_conf();
   bool save_conf();
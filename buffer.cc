@@ -31,6 +31,18 @@ void Buffer::clear() {
   for(unsigned int i=0; i<data.size(); i++) {
     free(data[i]);
   }
+  for(unsigned int i=0; i<spare.size(); i++) {
+    free(spare[i]);
+  }
+  data.clear();
+  spare.clear();
+  next = size;
+}
+
+
+// release all allocations but keep the memory for next use
+void Buffer::reset() {
+  spare.insert(spare.end(), data.begin(), data.end());
   data.clear();
   next = size;
 }
@@ -40,7 +52,12 @@ char* Buffer::allocate(unsigned int len) {
 
   char* ptr;
   if(next+len > size) {
-    ptr = (char*)malloc(size);
+    if(spare.size() > 0) {
+      ptr = spare.back();
+      spare.pop_back();
+    } else {
+      ptr = (char*)malloc(size);
+    }
     data.push_back(ptr);
     next = len;
   } else {
@@ -106,6 +123,15 @@ bool Buffer::test() {
   ptr = allocate(20);
   if(ptr == NULL || data.size() != 2) return false;
 
+  std::cout << "reset test\n"; 
+  char* first = get(0);
+  reset();
+  if(data.size() != 0 || spare.size() != 2) return false;
+  ptr = allocate(80);
+  ptr = allocate(50);
+  if(ptr == NULL || data.size() != 2 || spare.size() != 0) return false;
+  if(get(0) != first && get(1) != first) return false;
+
   std::cout << "realloc test\n"; 
   ptr = reallocate(1000000, 1000000);
   if(ptr == NULL || data.size() != 1) return false;
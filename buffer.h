@@ -29,10 +29,12 @@ class Buffer {
     void   resize(unsigned int);
 
     void   clear(); 
+    void   reset();
     bool   test();
 
   private:
     std::vector<char*> data;
+    std::vector<char*> spare;  // released by reset(), reused by allocate()
     unsigned int       size;
     unsigned int       next;
 };
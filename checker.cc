@@ -79,6 +79,24 @@ void test() {
       }
     }
 
+    if(modules[i] == "cache" || modules[i] == "all") {
+      std::cout << ">>>>checking query cache module...\n";
+      QueryCache c;
+      if(!c.test()) {
+        std::cout << "error\n";
+        exit(1);
+      }
+    }
+
+    if(modules[i] == "kernel" || modules[i] == "all") {
+      std::cout << ">>>>checking set kernel module...\n";
+      SetKernel k;
+      if(!k.test()) {
+        std::cout << "error\n";
+        exit(1);
+      }
+    }
+
     if(modules[i] == "shm" || modules[i] == "all") {
       std::cout << ">>>>checking shared memory module...\n";
       SharedMemoryAccess s(0, 0); 
@@ -213,7 +231,7 @@ void test() {
 
       // setup testdata
       Indexer indexer(work_path, "", &cfg.attrs, &shm, &morph, &common_buf);
-      Searcher searcher(work_path, "", &cfg.attrs, &shm);
+      Searcher searcher(work_path, "", &cfg.attrs, &shm, &morph);
 
       std::cout << ">>>> test for empty data\n";
       if(!searcher.test()) {
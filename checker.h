@@ -29,6 +29,8 @@
 #include "buffer.h"
 #include "indexer.h"
 #include "searcher.h"
+#include "query_cache.h"
+#include "set_kernel.h"
 
 #include <json.h>
 
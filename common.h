@@ -168,6 +168,7 @@
 #define SEARCH_NODE_TYPE_AND    1
 #define SEARCH_NODE_TYPE_OR     2
 #define SEARCH_NODE_TYPE_LEAF   3
+#define SEARCH_NODE_TYPE_ANDNOT 4
 
 #define SEARCH_CACHE_TYPE_NULL     0
 #define SEARCH_CACHE_TYPE_EQUAL    1
@@ -233,6 +234,9 @@ typedef std::vector< std::pair<int, int> >    RANGE_SET;
 typedef std::vector<struct MergeData>         MERGE_SET;
 
 typedef std::vector<struct SearchResultRange> SEARCH_RESULT_RANGE_SET;
+typedef std::map<unsigned short, std::vector<unsigned int> >  SECTOR_OFFSET_MAP;
+typedef std::map<std::pair<unsigned short, unsigned int>, int>  PHRASE_COUNT_MAP;
+typedef std::map<std::string, std::map<std::string, int> >      FACET_COUNT_MAP;
 typedef std::map<std::string, struct AttrDataType>  ATTR_TYPE_MAP;
 typedef std::vector<struct AttrDataType> ATTR_TYPE_SET;
 
@@ -368,10 +372,6 @@ struct SearchNode {
   int right_node;
 
   bool pos_check;
-
-  SearchHitData left_hit_cache;
-  SearchHitData right_hit_cache;
-
 };
 
 
@@ -387,6 +387,7 @@ struct SearchCache {
 struct SearchPartial {
   int   next_range;
   int   next_hit;
+  int   sorted;  // hits[0, sorted) are in order
 
   SEARCH_HIT_DATA_SET        hits;
   SEARCH_RESULT_RANGE_SET    ranges;
@@ -164,6 +164,12 @@ void DataController::set_link() {
 //  debug
 /////////////////////////////////////////////////////////
 bool DataController::set_sample(unsigned char attr_header) {
+  return set_sample(attr_header, 1);
+}
+
+
+// documents are divided into the sectors evenly
+bool DataController::set_sample(unsigned char attr_header, unsigned int sectors) {
   Buffer buf;
   INSERT_PHRASE_SET p_set;
   INSERT_DOCUMENT_SET d_set;
@@ -176,7 +182,12 @@ bool DataController::set_sample(unsigned char attr_header) {
     d_set.push_back(d);
     
   }
-  document.insert(d_set);
+  for(unsigned int s=0; s<sectors; s++) {
+    INSERT_DOCUMENT_SET part(d_set.begin()+s*d_cnt/sectors, d_set.begin()+(s+1)*d_cnt/sectors);
+    if(s > 0) document_data.set_next_sector();
+    document.insert(part);
+    std::copy(part.begin(), part.end(), d_set.begin()+s*d_cnt/sectors);
+  }
  
   std::cout << "phrase sample...\n"; 
   for(unsigned int i=0; i<p_cnt; i++) {
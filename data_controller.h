@@ -40,6 +40,7 @@ public:
   bool finish();
   void set_link();
   bool set_sample(unsigned char);
+  bool set_sample(unsigned char, unsigned int);
 
   bool test();
   void dump(std::string);
@@ -80,6 +80,7 @@ bool FileAccess::create() {
 
 bool FileAccess::remove_with_suffix() {
   clear_page();
+  clear_handler();
 
   WORD_SET suffix_files = get_suffix_files();
   for(unsigned int i=0; i<suffix_files.size(); i++) { 
@@ -115,12 +116,14 @@ WORD_SET FileAccess::get_suffix_files() {
 
 void FileAccess::set_file_name(std::string name) {
   clear_page();
+  clear_handler();
   file_name = name;
 }
 
 
 void FileAccess::set_file_name(std::string path, unsigned int data_type, std::string suffix) {
   clear_page();
+  clear_handler();
   file_name = path;
 
   if(data_type == DATA_TYPE_PHRASE_DATA) {
@@ -169,6 +172,7 @@ std::string FileAccess::get_file_name() {
 void FileAccess::set_page_size(unsigned int _page_size) {
   // destroy old page
   clear_page();
+  clear_handler();
 
   // page_size is rounded by getpagesize()
   if(_page_size % getpagesize() != 0) 
@@ -236,6 +240,7 @@ bool FileAccess::remove(std::string name) {
 bool FileAccess::remove() {
   if(!is_file()) return false;
   clear_page();
+  clear_handler();
   remove(file_name);
 
   return true;
@@ -297,10 +302,7 @@ void FileAccess::clear_handler() {
 
 // load page from file or shared memory
 void* FileAccess::load_page(unsigned short secno, unsigned int pageno, int mode) {
-  int page_offset = page_size * (pageno%page_carry);
-  void* map_ptr = NULL;
   std::string errmes;
-  FileHandler h;
 
   if(page_info.secno == secno && page_info.pageno == (int)pageno && page_info.mode != PAGE_NONE) {
     if(!set_page_info(secno, pageno, mode)) {
@@ -322,37 +324,13 @@ void* FileAccess::load_page(unsigned short secno, unsigned int pageno, int mode)
     return map_page(secno, pageno, mode);
   }
 
-  // cache hit
-  page_ptr = shm->load_unit(page_info);
-  if(page_ptr)  {
-    return page_ptr;
-  }
-
-  // mapping from file
-  h = get_handler(page_info); 
-  if(h.fd == -1) {
-    errmes = "File open failed";
-    goto load_error;
-  }
-
-  map_ptr = mmap(NULL, page_size, PROT_READ, MAP_SHARED, h.fd, page_offset);
-  if(map_ptr == MAP_FAILED) {
-    errmes = "File map failed";
-    goto load_error;
-  }
- 
-  // new unit with locking 
-  page_ptr = shm->new_unit(map_ptr, page_info, page_size);
+  // cache hit, or read from file into shared memory
+  page_ptr = shm->read_unit(this, page_info);
   if(!page_ptr) {
     errmes = "Page load failed";
     goto load_error;
   }
 
-  if(munmap(map_ptr, page_size) == -1) {
-    errmes = "Unmap failed";
-    goto load_error;
-  }
-
   return page_ptr;
 
 load_error:
@@ -390,30 +368,49 @@ bool FileAccess::save_page() {
 
 // save page to file
 bool FileAccess::write_page(void* src, unsigned int size) {
-  void* map_ptr = NULL;
-  int   page_offset = page_size * (page_info.pageno%page_carry);
+  off_t page_offset = (off_t)page_size * (page_info.pageno%page_carry);
 
   FileHandler h = get_handler(page_info);
   if(h.fd == -1) return false;
-  fcntl(h.fd, LOCK_EX);
 
-  map_ptr = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, h.fd, page_offset);
-  if(map_ptr == MAP_FAILED) {
-    return false;
+  unsigned int total_write_size = 0;
+  while(total_write_size < size) {
+    ssize_t n = pwrite(h.fd, (char*)src+total_write_size, size-total_write_size, page_offset+total_write_size);
+    if(n == -1) {
+      if(errno == EINTR) continue;
+      return false;
+    }
+    total_write_size += n;
   }
 
-  memcpy(map_ptr, src, size);
+  return true;
+}
+
 
-  if(munmap(map_ptr, page_size) == -1) {
-    return false;
+// read page from file, the area beyond the end of file is filled by 0
+bool FileAccess::read_page(void* dst, unsigned int size) {
+  off_t page_offset = (off_t)page_size * (page_info.pageno%page_carry);
+
+  FileHandler h = get_handler(page_info);
+  if(h.fd == -1) return false;
+
+  unsigned int total_read_size = 0;
+  while(total_read_size < size) {
+    ssize_t n = pread(h.fd, (char*)dst+total_read_size, size-total_read_size, page_offset+total_read_size);
+    if(n == -1) {
+      if(errno == EINTR) continue;
+      return false;
+    }
+    if(n == 0) break;
+    total_read_size += n;
   }
-  fcntl(h.fd, LOCK_UN);
+  if(total_read_size < size) memset((char*)dst+total_read_size, 0, size-total_read_size);
 
   return true;
 }
 
 
-bool FileAccess::clear_page() { // not save
+bool FileAccess::clear_page() { // not save, file handlers are kept
   bool result = true;
 
   if(shm) {
@@ -430,7 +427,6 @@ bool FileAccess::clear_page() { // not save
   }
 
   clear_page_info();
-  clear_handler();
   page_ptr = NULL;
 
   return result;
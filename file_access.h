@@ -96,6 +96,7 @@ public:
   bool  save_page();
   bool  clear_page();
   bool  write_page(void*, unsigned int);
+  bool  read_page(void*, unsigned int);
    
 
   bool  set_page_info(unsigned short, unsigned int, int);
@@ -397,6 +397,22 @@ int Indexer::get_integer_attr(JsonValue* attr_val){
 }
 
 
+// move phrase values of a parsed request into another buffer
+bool Indexer::copy_phrases(InsertRegularIndex& idx, Buffer& dst) {
+  for(unsigned int i=0; i<idx.phrases.size(); i++) {
+    char* c = idx.phrases[i].data.value;
+    int len = IS_ATTR_TYPE_STRING(c[0]) ? strlen(c+1)+2 : sizeof(int)+1;
+
+    char* ptr = dst.allocate(len);
+    if(!ptr) return false;
+    memcpy(ptr, c, len);
+    idx.phrases[i].data.value = ptr;
+  }
+
+  return true;
+}
+
+
 char* Indexer::get_phrase_data(unsigned char header, const void* val, unsigned int length) {
   char* ptr = buf->allocate(length + sizeof(unsigned char));
   if(!ptr) return NULL;
@@ -44,6 +44,7 @@ public:
   bool do_index(INSERT_REGULAR_INDEX_SET&);
 
   bool parse_request(InsertRegularIndex&, JsonValue*);
+  bool copy_phrases(InsertRegularIndex&, Buffer&);
 
   bool proc_remove_indexes(INSERT_REGULAR_INDEX_SET&);
   bool proc_insert_phrases(INSERT_REGULAR_INDEX_SET&);
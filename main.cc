@@ -1,25 +1,41 @@
+#include <limits.h>
 #include "common.h"
 #include "server.h"
 #include "indexer.h"
 #include "searcher.h"
+#include "query_cache.h"
 
 // global
 AppConfig          cfg;
 SharedMemoryAccess shm(0, 0);
 MorphController    morph;
+QueryCache         query_cache;
 
 INSERT_REGULAR_INDEX_SET cache;
 Buffer                   common_buf;
 
+// per worker thread, reused across requests
+struct ThreadContext {
+  MorphController morph;
+  Buffer          buf;
+  Searcher*       searcher;
+  Indexer*        indexer;
+};
+pthread_key_t  thread_context_key;
+pthread_once_t thread_context_once = PTHREAD_ONCE_INIT;
+
 bool  get_options(int, char* const);
 
 std::string app_request_handler(const char*, pthread_mutex_t*, int);
 void  do_indexer_request(JsonValue*, JsonValue*, pthread_mutex_t*, int);
 void  do_searcher_request(JsonValue*, JsonValue*, pthread_mutex_t*, int);
+void  do_stats_request(JsonValue*, JsonValue*);
+ThreadContext* get_thread_context(void);
 
 bool  exec_check(void);
 bool  app_wait(void);
 void  app_exit(int);
+void  app_shutdown();
 void  set_default_signal();
 void  set_child_signal();
 bool  format();
@@ -42,7 +58,7 @@ bool get_options(int argc, char* const argv[]) {
   // option setting
   char optchar;
   opterr = 0;
-  while((optchar=getopt(argc, argv, "dD:L:p:P:F:o:l:w:a:v")) != -1) {
+  while((optchar=getopt(argc, argv, "dD:L:p:P:F:o:l:w:n:a:t:s:q:f:c:v")) != -1) {
     if(optchar == 'd') {
       cfg.daemon = true;
       if(cfg.log_file == "") cfg.log_file = std::string(path_buf) + "/log/typhoon.log";
@@ -50,6 +66,11 @@ bool get_options(int argc, char* const argv[]) {
     else if(optchar == 'D') cfg.path = std::string(optarg);
     else if(optchar == 'L') cfg.log_file = std::string(optarg);
     else if(optchar == 'p') cfg.port = (unsigned short)atoi(optarg);
+    else if(optchar == 't') cfg.worker_count = (unsigned int)atoi(optarg);
+    else if(optchar == 's') cfg.search_threads = (unsigned int)atoi(optarg);
+    else if(optchar == 'q') cfg.queue_size   = (unsigned int)atoi(optarg);
+    else if(optchar == 'f') cfg.flush_interval = (unsigned int)atoi(optarg);
+    else if(optchar == 'c') cfg.cache_size     = (unsigned int)atoi(optarg);
     else if(optchar == 'P') {
       if(!optarg) {cfg.pid_file = "/var/run/typhoon.pid";}
       else {cfg.pid_file = std::string(optarg);}
@@ -57,6 +78,7 @@ bool get_options(int argc, char* const argv[]) {
     else if(optchar == 'o') {cfg.max_offset = (unsigned int)atoi(optarg);}
     else if(optchar == 'l') {cfg.max_limit  = (unsigned int)atoi(optarg);}
     else if(optchar == 'w') {cfg.max_words  = (unsigned int)atoi(optarg);}
+    else if(optchar == 'n') {cfg.max_count  = (unsigned int)atoi(optarg);}
     else if(optchar == 'F') {cfg.data_file = std::string(optarg);}
     else if(optchar == 'v') {
       std::cout << "Typhoon version 0.1\n";
@@ -86,6 +108,8 @@ std::string app_request_handler(const char* request_str, pthread_mutex_t* mutex,
     JsonValue* data_val = request ? request->get_value_by_tag("data") : NULL;
     do_indexer_request(data_val, reply, mutex, flags);
     shm.next_generation();
+  } else if(command=="stats") {
+    do_stats_request(request, reply);
   } else {
     std::string msg = "Invalid command: " + command;
     reply->add_to_object("error", new JsonValue(json_true));
@@ -101,46 +125,54 @@ std::string app_request_handler(const char* request_str, pthread_mutex_t* mutex,
 
 
 void do_indexer_request(JsonValue* request, JsonValue* reply, pthread_mutex_t* mutex, int flags) {
-   Indexer* i = NULL;
+   ThreadContext* ctx = get_thread_context();
+   Indexer* i = ctx->indexer;
+   bool locked = false;
+   bool flushing = false;
    try {
-     i = new Indexer(cfg.path, cfg.log_file, &cfg.attrs, &shm, &morph, &common_buf);
-
-     if(mutex) pthread_mutex_lock(mutex+MUTEX_PARSER);
      InsertRegularIndex idx;
      if(request) {
        if(!i->parse_request(idx, request))  throw AppException(EX_APP_INDEXER, "request parse failed");
      }
-     if(mutex) pthread_mutex_unlock(mutex+MUTEX_PARSER);
 
      if(mutex) pthread_mutex_lock(mutex+MUTEX_INDEXER_PROC1);
+     locked = true;
      if(request) {
+       if(!i->copy_phrases(idx, common_buf)) throw AppException(EX_APP_INDEXER, "request parse failed");
        cache.push_back(idx);
      }
      if((cache.size() > 0 && flags == INDEX_FLAG_FIN) || cache.size() > MAX_DOCUMENT_CACHE) {
+       flushing = true;
        i->proc_remove_indexes(cache);
        i->proc_insert_documents(cache);
        i->proc_insert_phrases(cache);
        i->proc_insert_regular_indexes(cache);
        i->proc_insert_reverse_indexes(cache);
        i->proc_sector_check(); 
+       query_cache.next_generation();
+       flushing = false;
 
        cache.clear();
        common_buf.clear();
      }
+     locked = false;
      if(mutex) pthread_mutex_unlock(mutex+MUTEX_INDEXER_PROC1);
 
-     delete i;
+     i->data.finish();
+     ctx->buf.reset();
 
      reply->add_to_object("error", new JsonValue(json_false));
      reply->add_to_object("message", new JsonValue("Success indexing document"));
   } catch(AppException e) {
-    if(mutex) {
-      pthread_mutex_unlock(mutex+MUTEX_PARSER);
-      pthread_mutex_unlock(mutex+MUTEX_INDEXER_PROC1);
+    if(locked) {
+      cache.clear();
+      common_buf.clear();
+      if(mutex) pthread_mutex_unlock(mutex+MUTEX_INDEXER_PROC1);
     }
-    if(i) delete i;
-    cache.clear();
-    common_buf.clear();
+    i->data.finish();
+    ctx->buf.reset();
+    // a flush that failed halfway may have changed the index
+    if(flushing) query_cache.next_generation();
 
     std::cout << e.what() << "\n";
     reply->add_to_object("error", new JsonValue(json_true));
@@ -150,37 +182,162 @@ void do_indexer_request(JsonValue* request, JsonValue* reply, pthread_mutex_t* m
 }
 
 
-void do_searcher_request(JsonValue* request, JsonValue* reply, pthread_mutex_t* mutex, int flags) {
-  Searcher* s = new Searcher(cfg.path, cfg.log_file, &cfg.attrs, &shm);
+// the request members that decide the result, in a fixed order
+static std::string query_cache_key(JsonValue* request) {
+  static const char* tags[] = {"conditions", "order", "offset", "limit", "count_only", "exact_count", "cursor", "facets"};
+  std::string key;
+  for(unsigned int i=0; i<sizeof(tags)/sizeof(tags[0]); i++) {
+    JsonValue* val = request ? request->get_value_by_tag(tags[i]) : NULL;
+    if(val) key += JsonExport::json_export(val);
+    key += "\t";
+  }
+  return key;
+}
+
+
+// true if the request member is true, as Searcher::parse_request reads it
+static bool request_flag(JsonValue* request, const char* tag) {
+  JsonValue* val = request ? request->get_value_by_tag(tag) : NULL;
+  return val && val->get_value_type() == json_true;
+}
+
+
+// true if the request names facet attributes
+static bool request_facets(JsonValue* request) {
+  JsonValue* val = request ? request->get_value_by_tag("facets") : NULL;
+  return val && val->get_value_type() == json_array && val->get_array_value()->size() > 0;
+}
 
-  try {
-    if(mutex) pthread_mutex_lock(mutex+MUTEX_PARSER);
-    if(!s->parse_request(request, cfg)) throw AppException(EX_APP_SEARCHER, "failed to parse request");
-    if(mutex) pthread_mutex_unlock(mutex+MUTEX_PARSER);
 
-    SEARCH_HIT_DATA_SET result;
-    int hit_count = s->do_search(result);
+void do_searcher_request(JsonValue* request, JsonValue* reply, pthread_mutex_t*, int flags) {
+  ThreadContext* ctx = get_thread_context();
+  Searcher* s = ctx->searcher;
+  s->init();
 
-    reply->add_to_object("count", new JsonValue(hit_count));
+  try {
+    QueryCacheEntry e;
+    e.key = query_cache_key(request);
+    e.generation = query_cache.get_generation();
+
+    if(!query_cache.find(e.key, e)) {
+      if(!s->parse_request(request, cfg)) throw AppException(EX_APP_SEARCHER, "failed to parse request");
+
+      SEARCH_HIT_DATA_SET result;
+      e.count = s->do_search(result);
+      e.exact = s->count_exact;
+      e.facets = s->facet_counts;
+      for(int i=s->offset; i<(int)result.size() && i<s->offset+s->limit; i++) {
+        e.ids.push_back(result[i].id);
+        e.cursor = s->make_cursor(result[i]);
+      }
+      query_cache.add(e);
+    }
+
+    reply->add_to_object("count", new JsonValue(e.count));
+    if(request_flag(request, "count_only") || request_flag(request, "exact_count") || request_facets(request)) {
+      reply->add_to_object("exact", new JsonValue(e.exact ? json_true : json_false));
+    }
+    if(request->get_value_by_tag("cursor") && request->get_value_by_tag("cursor")->get_value_type() == json_string) {
+      reply->add_to_object("cursor", e.cursor == "" ? new JsonValue(json_null) : new JsonValue(e.cursor));
+    }
+    if(request_facets(request)) {
+      JsonValue* facets = new JsonValue(json_object);
+      for(FACET_COUNT_MAP::iterator f=e.facets.begin(); f!=e.facets.end(); ++f) {
+        JsonValue* values = new JsonValue(json_object);
+        for(std::map<std::string, int>::iterator v=f->second.begin(); v!=f->second.end(); ++v) {
+          values->add_to_object(v->first, new JsonValue(v->second));
+        }
+        facets->add_to_object(f->first, values);
+      }
+      reply->add_to_object("facets", facets);
+    }
     reply->add_to_object("result", new JsonValue(json_array));
-    for(int i=s->offset; i<(int)result.size() && i<s->offset+s->limit; i++) {
-      reply->get_value_by_tag("result")->add_to_array(new JsonValue((int)result[i].id));
+    for(unsigned int i=0; i<e.ids.size(); i++) {
+      reply->get_value_by_tag("result")->add_to_array(new JsonValue((int)e.ids[i]));
     }
     reply->add_to_object("error", new JsonValue(json_null));
   } catch(AppException e) {
-    if(mutex) pthread_mutex_unlock(mutex+MUTEX_PARSER);
     write_log(LOG_LEVEL_ERROR, e.what(), cfg.log_file);
     reply->add_to_object("count", new JsonValue(0));
     reply->add_to_object("result", new JsonValue(json_array));
     reply->add_to_object("error", new JsonValue(e.what().c_str()));
   } catch(JsonException e) {
-    if(mutex) pthread_mutex_unlock(mutex+MUTEX_PARSER);
     reply->add_to_object("count", new JsonValue(0));
     reply->add_to_object("result", new JsonValue(json_array));
     reply->add_to_object("error", new JsonValue("JSON access error"));
   }
 
-  delete s;
+  s->finish();
+}
+
+
+static JsonValue* stats_value(unsigned long val) {
+  return new JsonValue(val > INT_MAX ? INT_MAX : (int)val);
+}
+
+// buffer pool counters per data type, {"reset":true} clears them after reading
+void do_stats_request(JsonValue* request, JsonValue* reply) {
+  static const char* type_names[] = {NULL, "pdata", "paddr", "ddata", "daddr", "regindex", "revindex",
+                                     "dinfo", "pinfo", "reginfo", "revinfo"};
+  JsonValue* reset_val = request ? request->get_value_by_tag("reset") : NULL;
+
+  reply->add_to_object("block_size", stats_value(shm.get_block_size()));
+  reply->add_to_object("page_size",  stats_value(shm.get_page_size()));
+  reply->add_to_object("used_blocks", stats_value(shm.get_used_blocks()));
+
+  JsonValue* types = new JsonValue(json_object);
+  for(unsigned int i=1; i<sizeof(type_names)/sizeof(type_names[0]); i++) {
+    SharedMemoryStats st = shm.get_stats(i << 24);
+    JsonValue* v = new JsonValue(json_object);
+    v->add_to_object("hit",            stats_value(st.hit));
+    v->add_to_object("miss",           stats_value(st.miss));
+    v->add_to_object("evict",          stats_value(st.evict));
+    v->add_to_object("write_back",     stats_value(st.write_back));
+    v->add_to_object("lock_wait_usec", stats_value(st.lock_wait));
+    types->add_to_object(type_names[i], v);
+  }
+  reply->add_to_object("types", types);
+
+  JsonValue* qc = new JsonValue(json_object);
+  qc->add_to_object("size",    stats_value(query_cache.get_size()));
+  qc->add_to_object("entries", stats_value(query_cache.get_entries()));
+  qc->add_to_object("hit",     stats_value(query_cache.get_hit()));
+  qc->add_to_object("miss",    stats_value(query_cache.get_miss()));
+  reply->add_to_object("query_cache", qc);
+  reply->add_to_object("error", new JsonValue(json_null));
+
+  if(reset_val && reset_val->get_value_type() == json_true) {
+    shm.clear_stats();
+    query_cache.clear_stats();
+  }
+}
+
+
+void delete_thread_context(void* p) {
+  ThreadContext* ctx = (ThreadContext*)p;
+  delete ctx->searcher;
+  delete ctx->indexer;
+  delete ctx;
+}
+
+
+void create_thread_context_key(void) {
+  pthread_key_create(&thread_context_key, delete_thread_context);
+}
+
+
+// searcher/indexer owned by the calling thread, created on first use
+ThreadContext* get_thread_context(void) {
+  pthread_once(&thread_context_once, create_thread_context_key);
+
+  ThreadContext* ctx = (ThreadContext*)pthread_getspecific(thread_context_key);
+  if(!ctx) {
+    ctx = new ThreadContext;
+    ctx->searcher = new Searcher(cfg.path, cfg.log_file, &cfg.attrs, &shm, &ctx->morph);
+    ctx->indexer  = new Indexer(cfg.path, cfg.log_file, &cfg.attrs, &shm, &ctx->morph, &ctx->buf);
+    pthread_setspecific(thread_context_key, ctx);
+  }
+  return ctx;
 }
 
 
@@ -236,7 +393,13 @@ bool app_wait(void) {
 
 
 
-void app_exit(int sig) {
+// signal handler: only stops the event loop, main() shuts down after it
+void app_exit(int) {
+  Server::stop();
+}
+
+void app_shutdown() {
+  shm.stop_flusher();
   write_log(LOG_LEVEL_INFO, "waiting other process...", cfg.log_file);
   if(!shm.lock_all()) {
     write_log(LOG_LEVEL_ERROR, "failed to wait other process...", cfg.log_file);
@@ -291,7 +454,7 @@ int main(int argc, char* const argv[]) {
   if(!get_options(argc, argv)) {
     std::cerr << "option error!!\n";
     std::cerr << "[usage]\n";
-    std::cerr << "typhoon [-D data_dir] [-L log_file] [-P pid_file] [-p port] [-t]\n";
+    std::cerr << "typhoon [-D data_dir] [-L log_file] [-P pid_file] [-p port] [-t worker_threads] [-s search_threads] [-q queue_size] [-f flush_interval] [-c cache_size] [-n max_count]\n";
     exit(1);
   } 
   if(!cfg.directory_check()) {
@@ -344,14 +507,22 @@ int main(int argc, char* const argv[]) {
     }
   }
 
+  // write back dirty pages in background (threads are not inherited by daemonize)
+  if(cfg.flush_interval > 0 && !shm.start_flusher(cfg.flush_interval)) {
+    write_log(LOG_LEVEL_ERROR, "failed to start flusher", cfg.log_file);
+  }
+
+  query_cache.set_size(cfg.cache_size);
+
   // server mode
   try {
     Server s(app_request_handler, app_wait);
-    s.start(cfg.port);
+    s.start(cfg.port, cfg.worker_count, cfg.queue_size);
   } catch(AppException e) {
     write_log(LOG_LEVEL_ERROR, e.what(), cfg.log_file);
   }
 
+  app_shutdown();
   return 0;
 }
 
@@ -0,0 +1,185 @@
+/*****************************************************************
+ *  query_cache.cc
+ *    search result cache
+ *
+ *****************************************************************/
+
+#include "query_cache.h"
+
+QueryCache::QueryCache() {
+  size = 0;
+  generation = 0;
+  hit = miss = 0;
+  pthread_mutex_init(&mutex, NULL);
+}
+
+QueryCache::QueryCache(unsigned int _size) {
+  size = _size;
+  generation = 0;
+  hit = miss = 0;
+  pthread_mutex_init(&mutex, NULL);
+}
+
+QueryCache::~QueryCache() {
+  pthread_mutex_destroy(&mutex);
+}
+
+
+// copy the cached entry of the key, false if missing or stale
+bool QueryCache::find(const std::string& key, QueryCacheEntry& e) {
+  if(size == 0) return false;
+
+  pthread_mutex_lock(&mutex);
+  QUERY_CACHE_MAP::iterator it = index.find(key);
+  if(it == index.end() || it->second->generation != generation) {
+    if(it != index.end()) remove(it);
+    miss++;
+    pthread_mutex_unlock(&mutex);
+    return false;
+  }
+
+  entries.splice(entries.begin(), entries, it->second);
+  e = *(it->second);
+  hit++;
+  pthread_mutex_unlock(&mutex);
+  return true;
+}
+
+
+// the entry's generation is the one read before the search,
+// results computed across an index request are not stored
+void QueryCache::add(const QueryCacheEntry& e) {
+  if(size == 0) return;
+
+  pthread_mutex_lock(&mutex);
+  if(e.generation != generation) {
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
+
+  QUERY_CACHE_MAP::iterator it = index.find(e.key);
+  if(it != index.end()) remove(it);
+
+  entries.push_front(e);
+  index[e.key] = entries.begin();
+
+  while(entries.size() > size) {
+    remove(index.find(entries.back().key));
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+
+unsigned int QueryCache::get_generation() {
+  pthread_mutex_lock(&mutex);
+  unsigned int val = generation;
+  pthread_mutex_unlock(&mutex);
+  return val;
+}
+
+
+// called after every index flush, old entries are removed lazily
+void QueryCache::next_generation() {
+  pthread_mutex_lock(&mutex);
+  generation++;
+  pthread_mutex_unlock(&mutex);
+}
+
+
+void QueryCache::remove(QUERY_CACHE_MAP::iterator it) {
+  entries.erase(it->second);
+  index.erase(it);
+}
+
+
+void QueryCache::set_size(unsigned int _size) {
+  pthread_mutex_lock(&mutex);
+  size = _size;
+  while(entries.size() > size) {
+    remove(index.find(entries.back().key));
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+unsigned int QueryCache::get_size() {
+  return size;
+}
+
+unsigned int QueryCache::get_entries() {
+  pthread_mutex_lock(&mutex);
+  unsigned int val = index.size();
+  pthread_mutex_unlock(&mutex);
+  return val;
+}
+
+unsigned long QueryCache::get_hit() {
+  pthread_mutex_lock(&mutex);
+  unsigned long val = hit;
+  pthread_mutex_unlock(&mutex);
+  return val;
+}
+
+unsigned long QueryCache::get_miss() {
+  pthread_mutex_lock(&mutex);
+  unsigned long val = miss;
+  pthread_mutex_unlock(&mutex);
+  return val;
+}
+
+
+void QueryCache::clear() {
+  pthread_mutex_lock(&mutex);
+  entries.clear();
+  index.clear();
+  pthread_mutex_unlock(&mutex);
+}
+
+void QueryCache::clear_stats() {
+  pthread_mutex_lock(&mutex);
+  hit = miss = 0;
+  pthread_mutex_unlock(&mutex);
+}
+
+
+
+////////////////////////////////////////////////////////////////////
+//  for debug
+////////////////////////////////////////////////////////////////////
+bool QueryCache::test() {
+  QueryCacheEntry e, result;
+  set_size(2);
+  clear();
+  clear_stats();
+  e.exact = true;
+  e.ids.push_back(1), e.ids.push_back(2);
+
+  std::cout << "add test\n";
+  e.key = "a", e.generation = get_generation(), e.count = 10;
+  add(e);
+  if(!find("a", result) || result.count != 10 || result.ids != e.ids) return false;
+  if(find("b", result)) return false;
+
+  std::cout << "LRU test\n";
+  e.key = "b", e.count = 20;
+  add(e);
+  if(!find("a", result)) return false;
+  e.key = "c", e.count = 30;
+  add(e);
+  if(get_entries() != 2) return false;
+  if(find("b", result)) return false;
+  if(!find("a", result) || !find("c", result) || result.count != 30) return false;
+
+  std::cout << "generation test\n";
+  next_generation();
+  if(find("a", result) || get_entries() != 1) return false;
+  e.key = "d", e.count = 40, e.exact = false;
+  add(e);
+  if(find("d", result)) return false;
+  e.generation = get_generation();
+  add(e);
+  if(!find("d", result) || result.count != 40 || result.exact) return false;
+  if(get_hit() != 5 || get_miss() != 4) return false;
+
+  clear();
+  return true;
+}
@@ -0,0 +1,63 @@
+/*****************************************************************
+ *  query_cache.h(class QueryCache)
+ *    brief:
+ *     class QueryCache keeps the results of recent search requests.
+ *     entries are dropped in LRU order, and all of them become
+ *     stale when an index request bumps the write generation.
+ *
+ *****************************************************************/
+
+#ifndef __QUERY_CACHE_H__
+#define __QUERY_CACHE_H__
+
+#include <pthread.h>
+
+#include "common.h"
+
+struct QueryCacheEntry {
+  std::string               key;
+  unsigned int              generation;
+  int                       count;
+  bool                      exact;
+  std::vector<unsigned int> ids;
+  std::string               cursor;
+  FACET_COUNT_MAP           facets;
+};
+
+typedef std::list<QueryCacheEntry>                         QUERY_CACHE_LIST;
+typedef std::map<std::string, QUERY_CACHE_LIST::iterator>  QUERY_CACHE_MAP;
+
+
+class QueryCache {
+  public:
+    QueryCache();
+    QueryCache(unsigned int);
+    ~QueryCache();
+
+    bool         find(const std::string&, QueryCacheEntry&);
+    void         add(const QueryCacheEntry&);
+    unsigned int get_generation();
+    void         next_generation();
+
+    void         set_size(unsigned int);
+    unsigned int get_size();
+    unsigned int get_entries();
+    unsigned long get_hit();
+    unsigned long get_miss();
+    void         clear();
+    void         clear_stats();
+    bool         test();
+
+  private:
+    QUERY_CACHE_LIST  entries;   // most recently used first
+    QUERY_CACHE_MAP   index;
+    unsigned int      size;
+    volatile unsigned int generation;
+    unsigned long     hit;
+    unsigned long     miss;
+    pthread_mutex_t   mutex;
+
+    void remove(QUERY_CACHE_MAP::iterator);
+};
+
+#endif
@@ -18,10 +18,12 @@
 #include <unistd.h>
 
 #include <iostream>
+#include <algorithm>
 #include "reverse_index_controller.h"
 
 ReverseIndexController::ReverseIndexController() {
   data = NULL;
+  page = NULL;
   phrase = NULL;
   document = NULL;
   info = NULL;
@@ -30,6 +32,7 @@ ReverseIndexController::ReverseIndexController() {
 
 ReverseIndexController::~ReverseIndexController() {
   data = NULL;
+  page = NULL;
   phrase = NULL;
   document = NULL;
   info = NULL;
@@ -41,6 +44,7 @@ bool ReverseIndexController::setup(std::string path, SharedMemoryAccess* _shm) {
   if(!FileAccess::is_directory(path)) return false;
   base_path = path;
   shm = _shm;
+  phrase_keys.clear();
 
   header = &(shm->get_header()->rev_header);
 
@@ -49,8 +53,10 @@ bool ReverseIndexController::setup(std::string path, SharedMemoryAccess* _shm) {
   info_file.set_file_name(path, DATA_TYPE_REVERSE_INDEX_INFO, "dat");
   info_file.set_shared_memory(shm);
 
-  data_limit = shm->get_page_size() / sizeof(ReverseIndex);
+  data_limit = shm->get_page_size() / sizeof(ReverseIndex) * REVPAGE_EXPANSION;
   info_limit = shm->get_page_size() / sizeof(ReverseIndexInfo);
+  code_limit = shm->get_page_size();
+  page_buf.resize(data_limit + 4);  // a decoded pair of headers may run over the last word
 
   return true;
 }
@@ -73,6 +79,7 @@ bool ReverseIndexController::init() { // without setting
 
 bool ReverseIndexController::clear() {
   buf.clear();
+  phrase_keys.clear();
   clear_data();
   clear_info();
 
@@ -230,6 +237,7 @@ REVERSE_INDEX_INFO_SET ReverseIndexController::insert_data(INSERT_REVERSE_INDEX_
   REVERSE_INDEX_INFO_SET after_insert;
 
   if(!load_data(current.pageno, PAGE_READWRITE)) return after_insert;
+  decode_data(0, current.count-1);
 
   MergeData init;
   init.src.first = 0, init.src.second = current.count-1;
@@ -244,7 +252,9 @@ REVERSE_INDEX_INFO_SET ReverseIndexController::insert_data(INSERT_REVERSE_INDEX_
     memmove(data+insert_count, data, sizeof(ReverseIndex)*current.count);
     total_count = merge_data(data, data+insert_count, indexes, merge);
 
-    if(total_count > 0 || current.flag == REVINFO_FLAG_RTERM) {
+    if(!store_data(data, total_count)) {
+      after_insert = split_data(data, total_count, current);
+    } else if(total_count > 0 || current.flag == REVINFO_FLAG_RTERM) {
       ReverseIndexInfo new_info = current;
       new_info.count = total_count;
       if(new_info.count > 0) set_max_info(data, new_info.count-1, new_info);
@@ -253,7 +263,7 @@ REVERSE_INDEX_INFO_SET ReverseIndexController::insert_data(INSERT_REVERSE_INDEX_
   } else {
     ReverseIndex* wbuf = (ReverseIndex*)malloc(sizeof(ReverseIndex)*total_count);
     total_count = merge_data(wbuf, data, indexes, merge);
-    if(total_count > data_limit) {
+    if(!store_data(wbuf, total_count)) {
       after_insert = split_data(wbuf, total_count, current);
     } else {
       memcpy(data, wbuf, sizeof(ReverseIndex)*total_count);
@@ -656,13 +666,200 @@ bool ReverseIndexController::clear_info() {
   return true;
 }
 
+// the words are decoded by decode_data.
+// a raw page written before the encoding is read as it is, and encoded when it is written
 bool ReverseIndexController::load_data(unsigned int pageno, int mode) {
-  data = (ReverseIndex*)data_file.load_page(0, pageno, mode);
-  if(!data) return false;
+  data = NULL;
+  page = (ReverseIndexPage*)data_file.load_page(0, pageno, mode);
+  if(!page) return false;
+
+  if(page->format != REVPAGE_FORMAT) {
+    if(mode != PAGE_READWRITE) {
+      data = (ReverseIndex*)page;
+      return true;
+    }
+    memcpy(&page_buf[0], page, shm->get_page_size());
+  }
+  data = &page_buf[0];
+
+  return true;
+}
+
+
+// decode the words from..to of the loaded page, and 2 words after them
+// which are read to compare a header with its first body
+void ReverseIndexController::decode_data(int from, int to) {
+  if(!page || page->format != REVPAGE_FORMAT) return;
+  if(to+2 < (int)page->count) to = to+2;
+  else                        to = page->count-1;
+  if(from < 0) from = 0;
+  if(from > to) return;
+
+  // the last skip point before from
+  ReverseIndexSkip* skip = (ReverseIndexSkip*)(page+1);
+  int l = 0, r = page->skips;
+  while(r-l > 1) {
+    int mid = (l+r)/2;
+    if((int)skip[mid].pos <= from) l = mid;
+    else                           r = mid;
+  }
+  decode_words(l, to);
+}
+
+
+static unsigned long long get_varint(const unsigned char*& p, const unsigned char* end) {
+  unsigned long long v = 0;
+  for(unsigned int shift=0; shift<64; shift+=7) {
+    if(p >= end) break;
+    v |= (unsigned long long)(*p & 0x7F) << shift;
+    if(!(*p++ & 0x80)) return v;
+  }
+  throw AppException(EX_APP_REVINDEX, "broken reverse index page");
+}
+
+
+static void put_varint(std::vector<unsigned char>& code, unsigned long long v) {
+  while(v >= 0x80) {
+    code.push_back((unsigned char)(v | 0x80));
+    v >>= 7;
+  }
+  code.push_back((unsigned char)v);
+}
+
+
+// decode the words from the skip point through the word to
+void ReverseIndexController::decode_words(unsigned int n, int to) {
+  ReverseIndexSkip* skip = (ReverseIndexSkip*)(page+1);
+  if(n >= page->skips || sizeof(ReverseIndexPage) + sizeof(ReverseIndexSkip)*page->skips + page->size > shm->get_page_size()) {
+    throw AppException(EX_APP_REVINDEX, "broken reverse index page");
+  }
+
+  const unsigned char* code = (const unsigned char*)(skip + page->skips);
+  const unsigned char* p    = code + skip[n].ofs;
+  const unsigned char* end  = code + page->size;
+  unsigned int h1 = 0, h2 = 0, ofs = 0, pos = 0;
+
+  for(int i=skip[n].pos; i<=to;) {
+    if(n+1 < page->skips && (int)skip[n+1].pos == i) {
+      h1 = h2 = ofs = pos = 0;
+      n++;
+    }
+
+    unsigned long long v = get_varint(p, end);
+    unsigned int w = (unsigned int)(v >> 3);
+
+    switch(v & REVCODE_MASK) {
+      case REVCODE_BODY_POS:
+        if(p >= end) throw AppException(EX_APP_REVINDEX, "broken reverse index page");
+        pos = *p++;
+        // fall through
+      case REVCODE_BODY:
+        w = (unsigned int)(v >> 2);
+        ofs = ofs + ((w >> 1) ^ (0 - (w & 1)));
+        data[i++].val = CREATE_REV_INDEX_BODY_FIRST(pos, ofs);
+        break;
+      case REVCODE_REPEAT:
+        data[i++].val = h1;
+        data[i++].val = h2;
+        break;
+      default:
+        if(v & REVCODE_SECOND) data[i++].val = h2 = 0xC0000000 | (w & 0x3FFFFFFF);
+        else                   data[i++].val = h1 = CREATE_REV_INDEX_HEADER_FIRST(w & 0x03, w >> 2);
+        break;
+    }
+  }
+}
+
+
+// encode the words into code_buf, returns the size of the page.
+// a body has the delta of the document offset from the previous body, and a header pair
+// same as the previous one is a byte. the delta and the pair are restarted at a skip point
+unsigned int ReverseIndexController::encode_data(ReverseIndex* buf, unsigned int count) {
+  std::vector<ReverseIndexSkip> skips;
+  std::vector<unsigned char>    words;
+  unsigned int h1 = 0, h2 = 0, ofs = 0, pos = 0;
+
+  for(unsigned int i=0; i<count;) {
+    unsigned int w = buf[i].val;
+    if(i == 0 || (IS_INDEX_HEADER_FIRST(w) && i >= skips.back().pos + REVPAGE_SKIP)) {
+      ReverseIndexSkip s = {i, (unsigned int)words.size()};
+      skips.push_back(s);
+      h1 = h2 = ofs = pos = 0;
+    }
+
+    if(IS_INDEX_BODY(w)) {
+      int delta = (int)REV_INDEX_DOCUMENT_OFFSET(w) - (int)ofs;
+      unsigned long long zigzag = ((unsigned int)delta << 1) ^ (unsigned int)(delta >> 31);
+      if(REV_INDEX_PHRASE_POS(w) == pos) {
+        put_varint(words, (zigzag << 2) | REVCODE_BODY);
+      } else {
+        put_varint(words, (zigzag << 2) | REVCODE_BODY_POS);
+        words.push_back(REV_INDEX_PHRASE_POS(w));
+      }
+      ofs = REV_INDEX_DOCUMENT_OFFSET(w), pos = REV_INDEX_PHRASE_POS(w);
+      i++;
+    } else if(w == h1 && i+1 < count && buf[i+1].val == h2) {
+      words.push_back(REVCODE_REPEAT);
+      i += 2;
+    } else if(IS_INDEX_HEADER_SECOND(w)) {
+      put_varint(words, ((unsigned long long)(w & 0x3FFFFFFF) << 3) | REVCODE_SECOND | REVCODE_HEADER);
+      h2 = w;
+      i++;
+    } else {
+      unsigned int v = (REV_INDEX_PHRASE_OFFSET(w) << 2) | REV_INDEX_PHRASE_WEIGHT(w);
+      put_varint(words, ((unsigned long long)v << 3) | REVCODE_HEADER);
+      h1 = w;
+      i++;
+    }
+  }
+
+  unsigned int size = sizeof(ReverseIndexPage) + sizeof(ReverseIndexSkip)*skips.size() + words.size();
+  code_buf.resize(size);
+  ReverseIndexPage* p = (ReverseIndexPage*)&code_buf[0];
+  p->format = REVPAGE_FORMAT;
+  p->count  = count;
+  p->skips  = skips.size();
+  p->size   = words.size();
+  if(skips.size() > 0) memcpy(p+1, &skips[0], sizeof(ReverseIndexSkip)*skips.size());
+  if(words.size() > 0) memcpy((ReverseIndexSkip*)(p+1) + skips.size(), &words[0], words.size());
+
+  return size;
+}
+
 
+// encode the words into the loaded page, false if they do not fit in it
+bool ReverseIndexController::store_data(ReverseIndex* buf, unsigned int count) {
+  if(count > data_limit) return false;
+  unsigned int size = encode_data(buf, count);
+  if(size > code_limit) return false;
+
+  memcpy(page, &code_buf[0], size);
   return true;
 }
 
+
+// words [first, last) of the loaded page which have the first entry not less than the key
+// (include_match: greater than the key). they are found by the heads of the skip points,
+// and only they are decoded.
+RANGE ReverseIndexController::skip_data(unsigned int count, unsigned short sector, PhraseData key, bool include_match) {
+  if(page->format != REVPAGE_FORMAT) return RANGE(0, count);
+
+  ReverseIndexSkip* skip = (ReverseIndexSkip*)(page+1);
+  int l = -1, r = page->skips;
+  while(r-l > 1) {
+    int mid = (l+r)/2;
+    decode_words(mid, skip[mid].pos+2 < page->count ? skip[mid].pos+2 : page->count-1);
+
+    int cmp = compare_key(data, skip[mid].pos, count, REVINFO_FLAG_NONE, sector, key);
+    if(cmp < 0 || (cmp == 0 && include_match)) l = mid;
+    else                                       r = mid;
+  }
+
+  RANGE s(l < 0 ? 0 : skip[l].pos, r < (int)page->skips ? skip[r].pos : count);
+  decode_data(s.first, s.second-1);
+  return s;
+}
+
 bool ReverseIndexController::load_info(unsigned int pageno, int mode) {
   info = (ReverseIndexInfo*)info_file.load_page(0, pageno, mode);
   if(!info) return false;
@@ -673,33 +870,48 @@ bool ReverseIndexController::load_info(unsigned int pageno, int mode) {
 
 REVERSE_INDEX_INFO_SET ReverseIndexController::split_data(ReverseIndex* wbuf, unsigned int count, ReverseIndexInfo current) {
   REVERSE_INDEX_INFO_SET after_info;
-  unsigned int split_pos = 0;
+  std::vector<unsigned int> points;  // head of each page
   for(unsigned int i=2;;i++) {
-    split_pos = (count+i)/i;  // avoid zero
-    if(split_pos < data_limit-1) break;
+    unsigned int split_pos = (count+i)/i;  // avoid zero
+    if(split_pos < data_limit-1 && split_points(wbuf, count, split_pos, points)) break;
   }
-
-  unsigned int left_pos = 0;
-  unsigned int right_pos = split_pos;
-  int ofs = 0;
-  while(!IS_INDEX_HEADER_FIRST(wbuf[right_pos-ofs].val)) {
-    ofs++;
-    if(right_pos <= left_pos+ofs) throw AppException(EX_APP_REVINDEX, "failed to split data");
-  }
-  right_pos = right_pos - ofs;
+  points.push_back(count);
 
   // first page
-  memcpy(data, wbuf+left_pos, sizeof(ReverseIndex)*(right_pos - left_pos));
-  ReverseIndexInfo first_info = {(right_pos-left_pos), current.pageno, 0, REVINFO_FLAG_NONE};
-  set_max_info(wbuf, right_pos-1, first_info);
+  store_data(wbuf, points[1]);
+  ReverseIndexInfo first_info = {points[1], current.pageno, 0, REVINFO_FLAG_NONE};
+  set_max_info(wbuf, points[1]-1, first_info);
   after_info.push_back(first_info);
 
 
   // splitted page
-  while(right_pos < count) {
-    left_pos = right_pos, right_pos = right_pos + split_pos + ofs;
-    ofs = 0;
+  for(unsigned int i=1; i+1<points.size(); i++) {
+    unsigned int left_pos = points[i], right_pos = points[i+1];
+    unsigned int size = encode_data(wbuf+left_pos, right_pos-left_pos);
+    data_file.add_page(&code_buf[0], 0, header->next_data, size);
+    ReverseIndexInfo add_info = {(right_pos-left_pos), header->next_data, 0, REVINFO_FLAG_NONE};
+    set_max_info(wbuf, right_pos-1, add_info);
+    after_info.push_back(add_info);
+    header->next_data++;
+  }
+
+  if(after_info.size() > 0 && current.flag == REVINFO_FLAG_RTERM) {
+    after_info[after_info.size()-1].flag = REVINFO_FLAG_RTERM;
+  }
 
+  return after_info;
+}
+
+
+// split the words about every split_pos at block heads, false if a page does not fit
+bool ReverseIndexController::split_points(ReverseIndex* wbuf, unsigned int count, unsigned int split_pos, std::vector<unsigned int>& points) {
+  points.clear();
+  points.push_back(0);
+
+  unsigned int left_pos = 0;
+  unsigned int right_pos = split_pos;
+  int ofs = 0;
+  while(left_pos < count) {
     if(right_pos >= count) right_pos = count;
     else {
       while(!IS_INDEX_HEADER_FIRST(wbuf[right_pos-ofs].val)) {
@@ -709,18 +921,14 @@ REVERSE_INDEX_INFO_SET ReverseIndexController::split_data(ReverseIndex* wbuf, un
       right_pos = right_pos - ofs;
     }
 
-    data_file.add_page(wbuf+left_pos, 0, header->next_data, sizeof(ReverseIndex)*(right_pos-left_pos));
-    ReverseIndexInfo add_info = {(right_pos-left_pos), header->next_data, 0, REVINFO_FLAG_NONE};
-    set_max_info(wbuf, right_pos-1, add_info);
-    after_info.push_back(add_info);
-    header->next_data++;
-  }
+    if(right_pos-left_pos > data_limit || encode_data(wbuf+left_pos, right_pos-left_pos) > code_limit) return false;
+    if(right_pos < count) points.push_back(right_pos);
 
-  if(after_info.size() > 0 && current.flag == REVINFO_FLAG_RTERM) {
-    after_info[after_info.size()-1].flag = REVINFO_FLAG_RTERM;
+    left_pos = right_pos, right_pos = right_pos + split_pos + ofs;
+    ofs = 0;
   }
 
-  return after_info;
+  return true;
 }
 
 
@@ -883,6 +1091,52 @@ InsertReverseIndex ReverseIndexController::get_index_data(ReverseIndex* idx, uns
   return i;
 }
 
+// compare (document sector, phrase) of the entry with the search key.
+// same order as get_index_data, but the document is not fetched and phrases are cached.
+int ReverseIndexController::compare_key(ReverseIndex* idx, unsigned int pos, unsigned int limit, char flag, 
+                                        unsigned short sector, PhraseData search) {
+  PhraseData key = {NULL};
+  int doc_sector = 0;
+
+  if(flag == REVINFO_FLAG_LTERM) {
+    doc_sector = DATA_SECTOR_LEFT;
+  } else if(flag == REVINFO_FLAG_RTERM) {
+    doc_sector = DATA_SECTOR_RIGHT;
+  } else if(flag == REVINFO_FLAG_NONE) {
+    key = find_phrase_key(get_phrase_addr(idx, pos));
+
+    if(IS_INDEX_BODY(idx[pos].val))                                doc_sector = get_document_addr(idx, pos).sector;
+    else if(pos+1 <= limit && IS_INDEX_BODY(idx[pos+1].val))       doc_sector = get_document_addr(idx, pos+1).sector;
+    else if(pos+2 <= limit && IS_INDEX_BODY(idx[pos+2].val))       doc_sector = get_document_addr(idx, pos+2).sector;
+  }
+
+  int cmp = doc_sector - sector;
+  if(cmp == 0) cmp = phrase_data_comp(key, search);
+  return cmp;
+}
+
+
+// the value is valid until the next call
+PhraseData ReverseIndexController::find_phrase_key(PhraseAddr addr) {
+  PhraseData result = {NULL};
+  if(addr.offset == NULL_PHRASE) return result;
+
+  unsigned long long k = ((unsigned long long)addr.sector << 32) | addr.offset;
+  PHRASE_KEY_MAP::iterator it = phrase_keys.find(k);
+  if(it == phrase_keys.end()) {
+    PhraseData d = phrase->find_data(addr, buf);
+    if(!d.value) return result;
+
+    unsigned int len = IS_ATTR_TYPE_STRING(d.value[0]) ? strlen(d.value+1)+2 : sizeof(int)+1;
+    if(phrase_keys.size() >= MAX_PHRASE_KEY_CACHE) phrase_keys.clear();
+    it = phrase_keys.insert(std::make_pair(k, std::string(d.value, len))).first;
+  }
+
+  result.value = (char*)it->second.data();
+  return result;
+}
+
+
 void ReverseIndexController::set_max_info(ReverseIndex* idx, unsigned int pos, ReverseIndexInfo& i) {
   if(i.flag != REVINFO_FLAG_NONE) return;
   if(IS_INDEX_BODY(idx[pos].val)) {
@@ -993,9 +1247,7 @@ unsigned int ReverseIndexController::find_range_common
       r = dstmid;
     }
     else {
-      InsertReverseIndex i = get_index_data(info[dstmid].max, 2, 2, info[dstmid].flag);
-      int cmp = (i.doc.addr.sector - sector);
-      if(cmp == 0) cmp = phrase_data_comp(i.phrase.data, pmin);
+      int cmp = compare_key(info[dstmid].max, 2, 2, info[dstmid].flag, sector, pmin);
 
       if(cmp < 0) l = dstmid;
       else        r = dstmid;
@@ -1014,9 +1266,7 @@ unsigned int ReverseIndexController::find_range_common
       r = dstmid;
     }
     else {
-      InsertReverseIndex i = get_index_data(info[dstmid].max, 2, 2, info[dstmid].flag);
-      int cmp = (i.doc.addr.sector - sector);
-      if(cmp == 0) cmp = phrase_data_comp(i.phrase.data, pmax);
+      int cmp = compare_key(info[dstmid].max, 2, 2, info[dstmid].flag, sector, pmax);
 
       if(cmp <= 0)  l = dstmid;
       else          r = dstmid;
@@ -1046,13 +1296,12 @@ int ReverseIndexController::find_left(const void* str_from, ReverseIndexInfo pag
   int l, r;
   PhraseData pmin = {(char*)str_from};
   load_data(page_info.pageno, PAGE_READONLY);
-  l = -1, r = page_info.count;
+  RANGE s = skip_data(page_info.count, sector, pmin, false);
+  l = s.first-1, r = s.second;
   while(r-l > 1) {
     int dstmid = (l+r)/2;
 
-    InsertReverseIndex i = get_index_data(data, dstmid, page_info.count, REVINFO_FLAG_NONE);
-    int cmp = (i.doc.addr.sector - sector);
-    if(cmp == 0) cmp = phrase_data_comp(i.phrase.data, pmin);
+    int cmp = compare_key(data, dstmid, page_info.count, REVINFO_FLAG_NONE, sector, pmin);
 
     if(cmp < 0) l = dstmid;
     else        r = dstmid;
@@ -1065,13 +1314,12 @@ int ReverseIndexController::find_right(const void* str_to, ReverseIndexInfo page
   PhraseData pmax = {(char*)str_to};
 
   load_data(page_info.pageno, PAGE_READONLY);
-  l = -1, r = page_info.count;
+  RANGE s = skip_data(page_info.count, sector, pmax, true);
+  l = s.first-1, r = s.second;
   while(r-l > 1) {
     int dstmid = (l+r)/2;
 
-    InsertReverseIndex i = get_index_data(data, dstmid, page_info.count, REVINFO_FLAG_NONE);
-    int cmp = (i.doc.addr.sector - sector);
-    if(cmp == 0) cmp = phrase_data_comp(i.phrase.data, pmax);
+    int cmp = compare_key(data, dstmid, page_info.count, REVINFO_FLAG_NONE, sector, pmax);
 
     if(cmp <= 0)  l = dstmid;
     else          r = dstmid;
@@ -1086,6 +1334,7 @@ unsigned int ReverseIndexController::search_range_to_idset(SearchResultRange& sr
 
   if(sr.pageno < 0)  return 0;
   load_data(sr.pageno, PAGE_READONLY);
+  decode_data(sr.left_offset, sr.right_offset);
 
   for(int i=sr.left_offset; i<=sr.right_offset; i++) {
     if(IS_INDEX_BODY(data[i].val)) {
@@ -1114,52 +1363,109 @@ int ReverseIndexController :: find_hit_data_partial(SEARCH_HIT_DATA_SET& hits, S
   if(idx >= sr_set.size()) return 0;
 
   load_data(sr_set[idx].pageno, PAGE_READONLY);
+  decode_data(sr_set[idx].left_offset, sr_set[idx].right_offset);
 
-  int cnt = 0;
+  // postings are ordered by sortkey, their documents are fetched in address order
+  // so that each ddata page is loaded once
+  std::vector<std::pair<unsigned long long, unsigned int> > addrs;  // document addr, hit
   for(int i=sr_set[idx].left_offset; i<=sr_set[idx].right_offset; i++) {
     if(IS_INDEX_BODY(data[i].val)) {
       DocumentAddr a = get_document_addr(data, i);
-      DocumentData d = document->find_by_addr(a);
-      SearchHitData h = {false, d.id, {0, 0, 0, 0}, REV_INDEX_PHRASE_POS(data[i].val)};
-      if(order.size() == 0) {
-        memcpy(&h.sortkey[0], &d.sortkey[0], sizeof(int)*SORT_KEY_COUNT);
-      } else {
-        int current_bit = 0;
-        unsigned int k, shift_bit, base;
-        for(unsigned int i=0; i<order.size(); i++) {
-          // align to bit head
-          k = order[i].bit_from >> 5;
-          shift_bit = order[i].bit_from & 0x1F;
-          base = d.sortkey[k] << shift_bit;
-          if(shift_bit + order[i].bit_len > 32) {
-            base = (base | d.sortkey[k+1] >> (order[i].bit_len-shift_bit));
-          }
-          if(order[i].bit_reverse_flag) base = base ^ 0xFFFFFFFF;
-          base = base & (0xFFFFFFFF << (32-order[i].bit_len));
-          
-
-          // map to hit data
-          k = current_bit >> 5;
-          shift_bit    =  current_bit & 0x1F;
-          unsigned int first_mask   =  base >> shift_bit;
-          h.sortkey[k] |= first_mask;
-          if(shift_bit + order[i].bit_len > 32) {
-            unsigned int second_mask  =  base << (32-shift_bit);
-            if(second_mask != 0) h.sortkey[k+1] |= second_mask;
-          }
-          current_bit += order[i].bit_len;
-        }
-      }
- 
-      hits.push_back(h); 
-      cnt++;
+      SearchHitData h = {false, 0, {0, 0, 0, 0}, REV_INDEX_PHRASE_POS(data[i].val)};
+      hits.push_back(h);
+      addrs.push_back(std::make_pair(((unsigned long long)a.sector << 32) | a.offset, hits.size()-1));
     }
   }
+  std::sort(addrs.begin(), addrs.end());
+
+  for(unsigned int i=0; i<addrs.size(); i++) {
+    DocumentAddr a = {(unsigned short)(addrs[i].first >> 32), (unsigned int)(addrs[i].first & 0xFFFFFFFF)};
+    DocumentData d = document->find_by_addr(a);
+    set_hit_data(hits[addrs[i].second], d, order);
+  }
   
+  return addrs.size();
+}
+
+
+// hit data of the last posting in the range.
+// postings are ordered by the document sortkey, which is not kept in the posting,
+// so one document is read to decide whether the whole range can be skipped
+bool ReverseIndexController::find_hit_data_last(SearchHitData& h, SEARCH_RESULT_RANGE_SET& sr_set, unsigned int idx, ATTR_TYPE_SET& order) {
+  if(idx >= sr_set.size() || sr_set[idx].pageno < 0) return false;
+
+  load_data(sr_set[idx].pageno, PAGE_READONLY);
+  decode_data(sr_set[idx].left_offset, sr_set[idx].right_offset);
+  for(int i=sr_set[idx].right_offset; i>=sr_set[idx].left_offset; i--) {
+    if(IS_INDEX_BODY(data[i].val)) {
+      DocumentData d = document->find_by_addr(get_document_addr(data, i));
+      SearchHitData last = {false, 0, {0, 0, 0, 0}, REV_INDEX_PHRASE_POS(data[i].val)};
+      set_hit_data(last, d, order);
+      h = last;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+// hits keyed by document address instead of sortkey, for counting.
+// documents are not read, so the hits are not in sortkey order
+int ReverseIndexController::find_addr_data_all(SEARCH_HIT_DATA_SET& hits, SEARCH_RESULT_RANGE_SET& sr_set) {
+  int cnt = 0;
+  for(unsigned int idx=0; idx<sr_set.size(); idx++) {
+    if(sr_set[idx].pageno < 0) continue;
+    load_data(sr_set[idx].pageno, PAGE_READONLY);
+    decode_data(sr_set[idx].left_offset, sr_set[idx].right_offset);
+    for(int i=sr_set[idx].left_offset; i<=sr_set[idx].right_offset; i++) {
+      if(IS_INDEX_BODY(data[i].val)) {
+        DocumentAddr a = get_document_addr(data, i);
+        SearchHitData h = {false, 0, {a.sector, a.offset, 0, 0}, REV_INDEX_PHRASE_POS(data[i].val)};
+        hits.push_back(h);
+        cnt++;
+      }
+    }
+  }
+
   return cnt;
 }
 
 
+void ReverseIndexController::set_hit_data(SearchHitData& h, DocumentData& d, ATTR_TYPE_SET& order) {
+  h.id = d.id;
+  if(order.size() == 0) {
+    memcpy(&h.sortkey[0], &d.sortkey[0], sizeof(int)*SORT_KEY_COUNT);
+    return;
+  }
+
+  int current_bit = 0;
+  unsigned int k, shift_bit, base;
+  for(unsigned int i=0; i<order.size(); i++) {
+    // align to bit head
+    k = order[i].bit_from >> 5;
+    shift_bit = order[i].bit_from & 0x1F;
+    base = d.sortkey[k] << shift_bit;
+    if(shift_bit + order[i].bit_len > 32) {
+      base = (base | d.sortkey[k+1] >> (order[i].bit_len-shift_bit));
+    }
+    if(order[i].bit_reverse_flag) base = base ^ 0xFFFFFFFF;
+    base = base & (0xFFFFFFFF << (32-order[i].bit_len));
+
+    // map to hit data
+    k = current_bit >> 5;
+    shift_bit    =  current_bit & 0x1F;
+    unsigned int first_mask   =  base >> shift_bit;
+    h.sortkey[k] |= first_mask;
+    if(shift_bit + order[i].bit_len > 32) {
+      unsigned int second_mask  =  base << (32-shift_bit);
+      if(second_mask != 0) h.sortkey[k+1] |= second_mask;
+    }
+    current_bit += order[i].bit_len;
+  }
+}
+
+
 bool ReverseIndexController::is_valid_info(ReverseIndexInfo* info, unsigned int total_count) {
     for(unsigned int i=0; i<total_count; i++) {
       if(info[i].flag == REVINFO_FLAG_NONE) return true;
@@ -1203,6 +1509,7 @@ void ReverseIndexController::dump(ReverseIndexInfo current) {
     }
   } else {
     load_data(current.pageno, PAGE_READONLY);
+    decode_data(0, current.count-1);
     dump(data, current.count);
   }
 }
@@ -1278,6 +1585,55 @@ bool ReverseIndexController::test() {
   if(phrase_addr.offset != 10 || phrase_addr.sector != 1) return false;
   
 
+  std::cout << "page encoding test...\n";
+  indexes.clear();
+  for(unsigned int p=0; p<50; p++) {
+    unsigned int h1 = CREATE_REV_INDEX_HEADER_FIRST(p % 4, rand() % 0x10000000);
+    unsigned int h2 = CREATE_REV_INDEX_HEADER_SECOND(rand() % 0x8000, p % 3);
+    unsigned int ofs = rand() % 0x1000000;
+    unsigned int n = 1 + rand() % (MAX_REVERSE_INDEX_BLOCK*3);
+    for(unsigned int j=0; j<n; j++) {
+      if(j % MAX_REVERSE_INDEX_BLOCK == 0) {
+        i.val = h1, indexes.push_back(i);
+        i.val = h2, indexes.push_back(i);
+      }
+      ofs = (j % 7 == 0) ? rand() % 0x1000000 : ofs + rand() % 1000;
+      i.val = CREATE_REV_INDEX_BODY_FIRST(rand() % 3 == 0 ? rand() % 0x80 : 0, ofs);
+      indexes.push_back(i);
+    }
+  }
+  i.val = CREATE_REV_INDEX_BODY_FIRST(0x7F, 0xFFFFFF);
+  indexes.push_back(i);
+
+  encode_data(&indexes[0], indexes.size());
+  std::vector<unsigned char> encoded = code_buf;
+  if(encoded.size() >= sizeof(ReverseIndex)*indexes.size()) return false;
+  page = (ReverseIndexPage*)&encoded[0];
+  data = &page_buf[0];
+  if(page->skips < indexes.size()/(REVPAGE_SKIP+MAX_REVERSE_INDEX_BLOCK+2)) return false;
+
+  decode_data(0, indexes.size()-1);
+  for(unsigned int k=0; k<indexes.size(); k++) {
+    if(data[k].val != indexes[k].val) return false;
+  }
+  for(unsigned int k=0; k<1000; k++) {
+    int from = rand() % indexes.size(), to = from + rand() % 100;
+    if(to >= (int)indexes.size()) to = indexes.size()-1;
+    memset(&page_buf[0], 0xFF, sizeof(ReverseIndex)*page_buf.size());
+    decode_data(from, to);
+    for(int n=from; n<=to; n++) {
+      if(data[n].val != indexes[n].val) return false;
+      if(IS_INDEX_BODY(data[n].val) && !(n == (int)indexes.size()-1)) {
+        doc_addr = get_document_addr(data, n);
+        DocumentAddr expect = get_document_addr(&indexes[0], n);
+        if(doc_addr.sector != expect.sector || doc_addr.offset != expect.offset) return false;
+      }
+    }
+  }
+  page = NULL;
+  data = NULL;
+  
+
   std::cout << "initialize...\n";
   if(!init()) return false;
 
@@ -1468,6 +1824,95 @@ bool ReverseIndexController::test() {
   }
 
 
+  std::cout << "skip point search test...\n";
+  data_limit = 4000;
+  inserts.clear();
+  for(unsigned int i=0; i<3000; i++) {
+    ins.doc = docs[i];
+    for(unsigned int j=10; j<13; j++) {
+      ins.phrase = phrases[j];
+      inserts.push_back(ins);
+    }
+  }
+  sort(inserts.begin(), inserts.end(), InsertReverseIndexComp());
+  insert(inserts);
+
+  for(unsigned int j=10; j<13; j++) {
+    res.clear();
+    find(phrases[j].data.value, res);
+    if(res.size() != 3000) return false;
+  }
+  res.clear();
+  find_between(phrases[10].data.value, phrases[12].data.value, res);
+  if(res.size() != 9000) return false;
+  res.clear();
+  find_between(phrases[11].data.value, phrases[11].data.value, res);
+  if(res.size() != 3000) return false;
+
+
+  std::cout << "encoded page split test...\n";
+  code_limit = 512;
+  inserts.clear();
+  for(unsigned int i=0; i<1000; i++) {
+    ins.doc = docs[i];
+    for(unsigned int j=20; j<23; j++) {
+      ins.phrase = phrases[j];
+      inserts.push_back(ins);
+    }
+  }
+  sort(inserts.begin(), inserts.end(), InsertReverseIndexComp());
+  insert(inserts);
+
+  for(unsigned int j=20; j<23; j++) {
+    res.clear();
+    find(phrases[j].data.value, res);
+    if(res.size() != 1000) return false;
+  }
+  code_limit = shm->get_page_size();
+
+
+  std::cout << "raw page test...\n";
+  // pages written before the encoding are read as they are
+  for(unsigned int p=0; p<header->next_data; p++) {
+    load_data(p, PAGE_READWRITE);
+    if(page->format != REVPAGE_FORMAT) continue;
+    unsigned int count = page->count;
+    decode_data(0, count-1);
+    memcpy(page, data, sizeof(ReverseIndex)*count);
+    if(count == 0) page->format = 0;
+    save_data();
+  }
+  for(unsigned int j=10; j<13; j++) {
+    res.clear();
+    find(phrases[j].data.value, res);
+    if(res.size() != 3000) return false;
+  }
+
+  // and encoded when they are written
+  ins.delete_flag = true;
+  inserts.clear();
+  for(unsigned int i=0; i<1500; i++) {
+    ins.doc = docs[i];
+    for(unsigned int j=10; j<13; j++) {
+      ins.phrase = phrases[j];
+      inserts.push_back(ins);
+    }
+  }
+  sort(inserts.begin(), inserts.end(), InsertReverseIndexComp());
+  insert(inserts);
+
+  for(unsigned int j=10; j<13; j++) {
+    res.clear();
+    find(phrases[j].data.value, res);
+    if(res.size() != 1500) return false;
+  }
+  for(unsigned int j=20; j<23; j++) {
+    res.clear();
+    find(phrases[j].data.value, res);
+    if(res.size() != 1000) return false;
+  }
+
+
   return true;
 }
 
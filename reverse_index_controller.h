@@ -14,6 +14,7 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <map>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -34,6 +35,39 @@
 #define REVINFO_FLAG_RTERM 0x02
 #define REVINFO_FLAG_EMPTY 0x04
 
+#define MAX_PHRASE_KEY_CACHE 8192  // decoded phrases kept for binary search
+
+#define REVPAGE_FORMAT    0x52564431  // head of an encoded data page, older raw pages start with a header word or 0
+#define REVPAGE_SKIP      64          // words between skip points at least
+#define REVPAGE_EXPANSION 4           // decoded words in a page per 32-bit word of the page
+
+// tag in the low bits of an encoded word
+#define REVCODE_MASK     0x03
+#define REVCODE_BODY     0x00  // body with the position of the previous body
+#define REVCODE_BODY_POS 0x01  // body followed by its position byte
+#define REVCODE_REPEAT   0x02  // header pair same as the previous one, a byte
+#define REVCODE_HEADER   0x03
+#define REVCODE_SECOND   0x04  // header: HEADER_SECOND
+
+typedef std::map<unsigned long long, std::string> PHRASE_KEY_MAP;
+
+// encoded data page:
+//   ReverseIndexPage, ReverseIndexSkip * skips, encoded words * size bytes
+// the encoding is restarted at each skip point, which is a block head(HEADER_FIRST),
+// so a part of the page can be decoded from the nearest skip point before it.
+struct ReverseIndexPage {
+  unsigned int format;
+  unsigned int count;  // decoded words
+  unsigned int skips;
+  unsigned int size;
+};
+
+struct ReverseIndexSkip {
+  unsigned int pos;  // word
+  unsigned int ofs;  // byte in the encoded words
+};
+
+
 struct ReverseIndexMerge {
   ReverseIndex* rbuf;
   ReverseIndex* wbuf;
@@ -78,6 +112,8 @@ public:
   
   int find_hit_data_all(SEARCH_HIT_DATA_SET&, SEARCH_RESULT_RANGE_SET&, ATTR_TYPE_SET&);
   int find_hit_data_partial(SEARCH_HIT_DATA_SET&, SEARCH_RESULT_RANGE_SET&, unsigned int, ATTR_TYPE_SET&);
+  bool find_hit_data_last(SearchHitData&, SEARCH_RESULT_RANGE_SET&, unsigned int, ATTR_TYPE_SET&);
+  int find_addr_data_all(SEARCH_HIT_DATA_SET&, SEARCH_RESULT_RANGE_SET&);
 
 
 private:
@@ -89,19 +125,30 @@ private:
 
   unsigned int data_limit;
   unsigned int info_limit;
+  unsigned int code_limit;  // bytes of an encoded data page
 
   DocumentController* document;
   PhraseController* phrase;
+  PHRASE_KEY_MAP    phrase_keys;  // phrase address -> value, phrase data is never rewritten
 
   ReverseIndexHeader* header;
-  ReverseIndex*       data;
+  ReverseIndex*       data;       // decoded words of the loaded page, or the page itself if it is raw
   ReverseIndexInfo*   info;
+  ReverseIndexPage*   page;       // loaded data page
+  REVERSE_INDEX_SET   page_buf;
+  std::vector<unsigned char> code_buf;
 
   REVERSE_INDEX_INFO_SET insert_info(INSERT_REVERSE_INDEX_SET&, ReverseIndexInfo, RANGE r);
   REVERSE_INDEX_INFO_SET insert_data(INSERT_REVERSE_INDEX_SET&, ReverseIndexInfo, RANGE r);
 
   bool load_data(unsigned int, int);
+  void decode_data(int, int);
+  void decode_words(unsigned int, int);
+  unsigned int encode_data(ReverseIndex*, unsigned int);
+  bool store_data(ReverseIndex*, unsigned int);
+  RANGE skip_data(unsigned int, unsigned short, PhraseData, bool);
   REVERSE_INDEX_INFO_SET split_data(ReverseIndex*, unsigned int, ReverseIndexInfo);
+  bool split_points(ReverseIndex*, unsigned int, unsigned int, std::vector<unsigned int>&);
   bool save_data();
   bool clear_data();
   bool init_data();
@@ -144,10 +191,14 @@ private:
   unsigned int search_range_to_idset(SearchResultRange&, ID_SET&);
   unsigned int find_range_common(const void*, const void*, SEARCH_RESULT_RANGE_SET&, ReverseIndexInfo, unsigned short);
 
+  int compare_key(ReverseIndex*, unsigned int, unsigned int, char, unsigned short, PhraseData);
+  PhraseData find_phrase_key(PhraseAddr);
+
   int find_left(const void*, ReverseIndexInfo, unsigned short);
   int find_right(const void*, ReverseIndexInfo, unsigned short);
 
   int rewrite_data(ReverseIndex*, int, int);
+  void set_hit_data(SearchHitData&, DocumentData&, ATTR_TYPE_SET&);
 };
 
 
@@ -0,0 +1,301 @@
+/*****************************************************************
+ *  search_iterator.cc
+ *    iterators over the hits of a search condition tree
+ *
+ *******************************************************************/
+#include "search_iterator.h"
+
+
+// NULL is after any hit
+static int compare_weak(const SearchHitData* a, const SearchHitData* b) {
+  if(!a && !b) return 0;
+  if(!a)       return 1;
+  if(!b)       return -1;
+  return search_hit_data_comp_weak(*a, *b);
+}
+
+
+// heap order of the partials by their current hits, the smallest on top
+class PartialHeadComp {
+  public:
+    PartialHeadComp(SearchCache& _cache) : cache(_cache) {}
+
+    bool operator() (int a, int b) const {
+      SearchPartial& pa = cache.partials[a];
+      SearchPartial& pb = cache.partials[b];
+      int cmp = search_hit_data_comp(pa.hits[pa.next_hit], pb.hits[pb.next_hit]);
+      return cmp != 0 ? cmp > 0 : a > b;
+    }
+
+  private:
+    SearchCache& cache;
+};
+
+
+
+////////////////////////////////////////////////////////////////////
+//  term
+////////////////////////////////////////////////////////////////////
+TermIterator::TermIterator(SearchCache& _cache, ReverseIndexController& _reverse_index, ATTR_TYPE_SET& _order)
+  : cache(_cache), reverse_index(_reverse_index), order(_order) {
+  current = -1;
+  started = false;
+}
+
+
+const SearchHitData* TermIterator::next() {
+  if(!started) {
+    start();
+  } else if(current >= 0 && fill(cache.partials[current])) {
+    push(current);
+  }
+
+  current = -1;
+  if(heap.size() == 0) return NULL;
+
+  current = pop();
+  SearchPartial& p = cache.partials[current];
+  return &p.hits[p.next_hit++];
+}
+
+
+const SearchHitData* TermIterator::seek(const SearchHitData& target) {
+  SearchHitData t = target;  // target may be a hit of this iterator
+
+  started = true;
+  current = -1;
+  heap.clear();
+  for(unsigned int i=0; i<cache.partials.size(); i++) {
+    SearchPartial& p = cache.partials[i];
+    if(p.ranges.size() == 0) continue;
+    skip(p, t);
+    if(fill(p)) push(i);
+  }
+
+  return next();
+}
+
+
+void TermIterator::start() {
+  started = true;
+  heap.clear();
+  for(unsigned int i=0; i<cache.partials.size(); i++) {
+    if(cache.partials[i].ranges.size() == 0) continue;
+    if(fill(cache.partials[i])) push(i);
+  }
+}
+
+
+// load the next range if the hits are used up, false at the end
+bool TermIterator::fill(SearchPartial& p) {
+  while(p.next_hit >= (int)p.hits.size()) {
+    p.hits.clear();
+    if(p.next_range >= (int)p.ranges.size()) return false;
+    reverse_index.find_hit_data_partial(p.hits, p.ranges, p.next_range, order);
+    p.sorted = p.hits.size();
+    p.next_hit = 0;
+    p.next_range++;
+  }
+  sort_partial(p, p.next_hit);
+
+  return true;
+}
+
+
+// skip to the first hit not before the target.
+// a range whose last hit is before the target is passed after reading only the document
+// of its last posting, and the loaded hits are searched by galloping.
+void TermIterator::skip(SearchPartial& p, const SearchHitData& target) {
+  while(p.next_hit >= (int)p.hits.size() ||
+        (p.sorted >= (int)p.hits.size() && search_hit_data_comp_weak(p.hits[p.hits.size()-1], target) < 0)) {
+    p.next_hit = p.hits.size();
+    if(p.next_range >= (int)p.ranges.size()) return;
+
+    SearchHitData last;
+    if(reverse_index.find_hit_data_last(last, p.ranges, p.next_range, order) &&
+       search_hit_data_comp_weak(last, target) < 0) {
+      p.next_range++;
+      continue;
+    }
+
+    p.hits.clear();
+    reverse_index.find_hit_data_partial(p.hits, p.ranges, p.next_range, order);
+    p.sorted = p.hits.size();
+    p.next_hit = 0;
+    p.next_range++;
+  }
+
+  // hits[l] is before the target, hits[r] is not
+  int l = p.next_hit-1, r = p.next_hit, step = 1;
+  sort_partial(p, r);
+  while(search_hit_data_comp_weak(p.hits[r], target) < 0) {
+    l = r;
+    if(r == (int)p.hits.size()-1) break;
+    r = (l+step < (int)p.hits.size()) ? l+step : p.hits.size()-1;
+    step <<= 1;
+    sort_partial(p, r);
+  }
+  if(l == r) {  // all hits are before the target
+    p.next_hit = p.hits.size();
+    return;
+  }
+  while(r-l > 1) {
+    int mid = (l+r)/2;
+    if(search_hit_data_comp_weak(p.hits[mid], target) < 0) l = mid;
+    else                                                   r = mid;
+  }
+  p.next_hit = r;
+}
+
+
+// sort the hits up to hits[pos]. the sorted part grows twice each time,
+// so a request for the first offset+limit hits does not sort all of them.
+void TermIterator::sort_partial(SearchPartial& p, int pos) {
+  if(pos < p.sorted || p.sorted >= (int)p.hits.size()) return;
+
+  int end = p.sorted * 2;
+  if(end < pos+1)             end = pos+1;
+  if(end < MIN_PARTIAL_SORT)  end = MIN_PARTIAL_SORT;
+  if(end > (int)p.hits.size()) end = p.hits.size();
+
+  std::partial_sort(p.hits.begin()+p.sorted, p.hits.begin()+end, p.hits.end(), SearchHitDataComp());
+  p.sorted = end;
+}
+
+
+void TermIterator::push(int partial) {
+  heap.push_back(partial);
+  std::push_heap(heap.begin(), heap.end(), PartialHeadComp(cache));
+}
+
+
+int TermIterator::pop() {
+  std::pop_heap(heap.begin(), heap.end(), PartialHeadComp(cache));
+  int partial = heap.back();
+  heap.pop_back();
+  return partial;
+}
+
+
+
+////////////////////////////////////////////////////////////////////
+//  AND/OR
+////////////////////////////////////////////////////////////////////
+BinaryIterator::BinaryIterator(SearchIterator* _left, SearchIterator* _right) {
+  left  = _left;
+  right = _right;
+  left_hit = right_hit = NULL;
+}
+
+
+// both sides are moved to the target, the current hits after it are kept
+const SearchHitData* BinaryIterator::seek(const SearchHitData& target) {
+  SearchHitData t = target;  // target may be a hit of this iterator
+  if(!left_hit  || search_hit_data_comp_weak(*left_hit, t) < 0)  left_hit  = left->seek(t);
+  if(!right_hit || search_hit_data_comp_weak(*right_hit, t) < 0) right_hit = right->seek(t);
+
+  return next();
+}
+
+
+OrIterator::OrIterator(SearchIterator* _left, SearchIterator* _right) : BinaryIterator(_left, _right) {
+}
+
+
+const SearchHitData* OrIterator::next() {
+  if(!left_hit)  left_hit  = left->next();
+  if(!right_hit) right_hit = right->next();
+  if(!left_hit && !right_hit) return NULL;
+
+  const SearchHitData* hit;
+  int cmp = compare_weak(left_hit, right_hit);
+  if(cmp == 0) {
+    hit = left_hit;
+    left_hit = right_hit = NULL;
+  } else if(cmp < 0) {
+    hit = left_hit;
+    left_hit = NULL;
+  } else {
+    hit = right_hit;
+    right_hit = NULL;
+  }
+
+  return hit;
+}
+
+
+AndIterator::AndIterator(SearchIterator* _left, SearchIterator* _right) : BinaryIterator(_left, _right) {
+}
+
+
+const SearchHitData* AndIterator::next() {
+  if(!left_hit)  left_hit  = left->next();
+  if(!right_hit) right_hit = right->next();
+
+  while(left_hit && right_hit) {
+    int weak_cmp = search_hit_data_comp_weak(*left_hit, *right_hit);
+    int cmp = compare(left_hit, right_hit, weak_cmp);
+
+    // the lagging side leaps to the other document, positions in a document are stepped
+    if(cmp == 0) {
+      const SearchHitData* hit = left_hit;
+      left_hit = right_hit = NULL;
+      return hit;
+    } else if(cmp < 0) {
+      left_hit  = (weak_cmp != 0) ? left->seek(*right_hit) : left->next();
+    } else {
+      right_hit = (weak_cmp != 0) ? right->seek(*left_hit) : right->next();
+    }
+  }
+
+  return NULL;
+}
+
+
+int AndIterator::compare(const SearchHitData*, const SearchHitData*, int weak_cmp) {
+  return weak_cmp;
+}
+
+
+AndNotIterator::AndNotIterator(SearchIterator* _left, SearchIterator* _right) : BinaryIterator(_left, _right) {
+  right_end = false;
+}
+
+
+// the right side is only sought to the documents of the left hits
+const SearchHitData* AndNotIterator::next() {
+  if(!left_hit) left_hit = left->next();
+
+  while(left_hit) {
+    if(!right_end && (!right_hit || search_hit_data_comp_weak(*right_hit, *left_hit) < 0)) {
+      right_hit = right->seek(*left_hit);
+      right_end = (right_hit == NULL);
+    }
+    if(right_end || search_hit_data_comp_weak(*right_hit, *left_hit) != 0) {
+      const SearchHitData* hit = left_hit;
+      left_hit = NULL;
+      return hit;
+    }
+    left_hit = left->next();
+  }
+
+  return NULL;
+}
+
+
+const SearchHitData* AndNotIterator::seek(const SearchHitData& target) {
+  SearchHitData t = target;  // target may be a hit of this iterator
+  if(!left_hit || search_hit_data_comp_weak(*left_hit, t) < 0) left_hit = left->seek(t);
+
+  return next();
+}
+
+
+PhraseIterator::PhraseIterator(SearchIterator* _left, SearchIterator* _right) : AndIterator(_left, _right) {
+}
+
+
+int PhraseIterator::compare(const SearchHitData* l, const SearchHitData* r, int weak_cmp) {
+  if(weak_cmp == 0 && l->pos - r->pos != 1) return l->pos - r->pos;
+  return weak_cmp;
+}
@@ -0,0 +1,121 @@
+/*****************************************************************
+ *  search_iterator.h
+ *    brief:
+ *     iterators over the hits of a search condition tree.
+ *     next() returns the next hit and seek() the first hit not
+ *     before the target (weak comparison), NULL at the end.
+ *     a returned hit is valid until the iterator is called again.
+ *
+ ****************************************************************/
+
+#ifndef __SEARCH_ITERATOR_H__
+#define __SEARCH_ITERATOR_H__
+
+#include <vector>
+
+#include "common.h"
+#include "reverse_index_controller.h"
+
+#define MIN_PARTIAL_SORT 64
+
+
+class SearchIterator {
+public:
+  virtual ~SearchIterator() {}
+
+  virtual const SearchHitData* next() = 0;
+  virtual const SearchHitData* seek(const SearchHitData&) = 0;
+};
+
+
+class EmptyIterator : public SearchIterator {
+public:
+  const SearchHitData* next() { return NULL; }
+  const SearchHitData* seek(const SearchHitData&) { return NULL; }
+};
+
+
+// hits of a leaf condition, merged from the partials (sectors) by a heap
+class TermIterator : public SearchIterator {
+public:
+  TermIterator(SearchCache&, ReverseIndexController&, ATTR_TYPE_SET&);
+
+  const SearchHitData* next();
+  const SearchHitData* seek(const SearchHitData&);
+
+private:
+  SearchCache&            cache;
+  ReverseIndexController& reverse_index;
+  ATTR_TYPE_SET&          order;
+
+  std::vector<int> heap;     // partials with a current hit
+  int              current;  // partial of the last returned hit
+  bool             started;
+
+  bool fill(SearchPartial&);
+  void skip(SearchPartial&, const SearchHitData&);
+  void sort_partial(SearchPartial&, int);
+  void push(int);
+  int  pop();
+  void start();
+};
+
+
+// common part of AND/OR, the current hits of both sides
+class BinaryIterator : public SearchIterator {
+public:
+  BinaryIterator(SearchIterator*, SearchIterator*);
+
+  const SearchHitData* seek(const SearchHitData&);
+
+protected:
+  SearchIterator* left;
+  SearchIterator* right;
+  const SearchHitData* left_hit;   // NULL if it should be read
+  const SearchHitData* right_hit;
+};
+
+
+class OrIterator : public BinaryIterator {
+public:
+  OrIterator(SearchIterator*, SearchIterator*);
+
+  const SearchHitData* next();
+};
+
+
+class AndIterator : public BinaryIterator {
+public:
+  AndIterator(SearchIterator*, SearchIterator*);
+
+  const SearchHitData* next();
+
+protected:
+  virtual int compare(const SearchHitData*, const SearchHitData*, int);
+};
+
+
+// hits of the left side whose documents have no hit on the right side
+class AndNotIterator : public BinaryIterator {
+public:
+  AndNotIterator(SearchIterator*, SearchIterator*);
+
+  const SearchHitData* next();
+  const SearchHitData* seek(const SearchHitData&);
+
+private:
+  bool right_end;
+};
+
+
+// the left hit must follow the right hit in the same document
+class PhraseIterator : public AndIterator {
+public:
+  PhraseIterator(SearchIterator*, SearchIterator*);
+
+protected:
+  int compare(const SearchHitData*, const SearchHitData*, int);
+};
+
+
+#endif // __SEARCH_ITERATOR_H__
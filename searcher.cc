@@ -9,16 +9,20 @@
 #include "searcher.h"
 
 Searcher::Searcher() {
-  setup(".", "", NULL, NULL);
+  setup(".", "", NULL, NULL, NULL);
 }
 
 
-Searcher::Searcher(std::string _path, std::string _log_file, ATTR_TYPE_MAP* _attrs, SharedMemoryAccess* _shm) {
-  setup(_path, _log_file, _attrs, _shm);
+Searcher::Searcher(std::string _path, std::string _log_file, ATTR_TYPE_MAP* _attrs, SharedMemoryAccess* _shm, MorphController* _morph) {
+  setup(_path, _log_file, _attrs, _shm, _morph);
 }
 
 
 Searcher::~Searcher() {
+  for(unsigned int i=0; i<workers.size(); i++) {
+    delete workers[i];
+  }
+  clear_iterators();
   buf.clear();
   nodes.clear();
   caches.clear();
@@ -32,19 +36,40 @@ void Searcher::init() {
   limit  = 10;
   root_node = -1;
   lazy_count = true;
-
-  buf.clear();
+  count_only  = false;
+  exact_count = false;
+  count_exact = true;
+  max_count   = INT_MAX;
+  cursor.empty = true;
+  search_threads = 1;
+  sector_from = 0;
+  sector_to   = MAX_SECTOR;
+
+  clear_iterators();
+  buf.reset();
   nodes.clear();
   caches.clear();
   order.clear();
+  facet_names.clear();
+  facet_types.clear();
+  facet_phrases.clear();
+  facet_hits.clear();
+  facet_counts.clear();
 }
 
 
-void Searcher::setup(std::string _path, std::string _log_file, ATTR_TYPE_MAP* _attrs, SharedMemoryAccess* _shm) {
+// release pages left by an interrupted search
+void Searcher::finish() {
+  data.finish();
+}
+
+
+void Searcher::setup(std::string _path, std::string _log_file, ATTR_TYPE_MAP* _attrs, SharedMemoryAccess* _shm, MorphController* _morph) {
   path = _path;
   log_file = _log_file;
   attrs = _attrs;
   shm = _shm;
+  morph = _morph;
 
   init();
   data.setup(path, shm);
@@ -64,6 +89,18 @@ bool Searcher::parse_request(JsonValue* request, AppConfig& cfg) {
   if(limit < 0)  limit = 0;
   if(limit  > (int)cfg.max_limit)  limit = (int)cfg.max_limit;
 
+  JsonValue* count_only_val  = request->get_value_by_tag("count_only");
+  JsonValue* exact_count_val = request->get_value_by_tag("exact_count");
+  count_only  = count_only_val  && count_only_val->get_value_type()  == json_true;
+  exact_count = exact_count_val && exact_count_val->get_value_type() == json_true;
+  if(count_only)  offset = limit = 0;
+  if(!parse_facets(request->get_value_by_tag("facets"))) return false;
+  if(count_only || exact_count || facet_names.size() > 0) {
+    lazy_count = false;
+    max_count  = (int)cfg.max_count;
+  }
+  search_threads = (int)cfg.search_threads;
+
   JsonValue* val = request->get_value_by_tag("conditions");
   SearchNode n = {SEARCH_NODE_TYPE_OR, -1, -1, -1, false};
   n.left_node  = parse_conditions(val); 
@@ -72,6 +109,10 @@ bool Searcher::parse_request(JsonValue* request, AppConfig& cfg) {
   root_node = nodes.size()-1;
 
   if(!parse_order(request->get_value_by_tag("order"))) return false;
+  if(!parse_cursor(request->get_value_by_tag("cursor"))) return false;
+
+  // count_only hits are keyed by document address, a cursor can not be placed among them
+  if(count_only && request->get_value_by_tag("cursor")) return false;
 
   return true;  
 }
@@ -100,6 +141,31 @@ bool Searcher::parse_order(JsonValue* val) {
 
 
 
+// facet attributes must have their values as phrases: indexed and not fulltext,
+// or not registered
+bool Searcher::parse_facets(JsonValue* val) {
+  if(!val) return true;
+  if(val->get_value_type() != json_array) return false;
+
+  for(unsigned int i=0; i<val->get_array_value()->size(); i++) {
+    JsonValue* name_val = val->get_array_value()->at(i);
+    if(name_val->get_value_type() != json_string) return false;
+
+    std::string name = name_val->get_string_value();
+    AttrDataType attr_type = {CREATE_ATTR_HEADER(0, ATTR_TYPE_STRING), false, false, false, false, false, 0, 0};
+    ATTR_TYPE_MAP::iterator it = attrs->find(name);
+    if(it != attrs->end()) {
+      attr_type = it->second;
+      if(!attr_type.index_flag || attr_type.fulltext_flag) return false;
+    }
+    facet_names.push_back(name);
+    facet_types.push_back(attr_type);
+  }
+
+  return true;
+}
+
+
 int Searcher::parse_conditions(JsonValue* val) {
   if(!val) return -1;
   if(val->get_value_type() != json_array) return -1;
@@ -113,14 +179,26 @@ int Searcher::parse_conditions(JsonValue* val) {
   else if(first_node->get_value_type() == json_array) {
     int cnt = 0;
     int current = -1;
+    std::vector<int> exclusions;
     while(JsonValue* child = val->get_value_by_index(cnt)) {
+      int child_node = parse_conditions_level1(child);
+      cnt++;
+      if(child_node >= 0 && nodes[child_node].type == SEARCH_NODE_TYPE_ANDNOT && nodes[child_node].left_node == -1) {
+        exclusions.push_back(child_node);
+        continue;
+      }
+
       SearchNode n = {SEARCH_NODE_TYPE_AND, -1, -1, -1, false};
-      n.left_node  = parse_conditions_level1(child);
+      n.left_node  = child_node;
       n.right_node = current; 
       nodes.push_back(n);
       current = nodes.size()-1;
+    }
 
-      cnt++;
+    // not_equal conditions are taken from the AND of the others
+    for(unsigned int i=0; i<exclusions.size(); i++) {
+      nodes[exclusions[i]].left_node = current;
+      current = exclusions[i];
     }
 
     return current;
@@ -171,6 +249,9 @@ int Searcher::parse_conditions_leaf(JsonValue* val) {
 
   JsonValue* second_node = val->get_value_by_index(1);
   std::string op = second_node->get_string_value();
+  if(op == "not_equal") {
+    return parse_conditions_exclusion(val, attr_name, attr_type);
+  }
   if(attr_type.fulltext_flag && op == "equal") {
     return parse_conditions_fulltext(val->get_value_by_index(2), attr_name, attr_type);
   }
@@ -201,13 +282,36 @@ int Searcher::parse_conditions_leaf(JsonValue* val) {
 }
 
 
+// ANDNOT node of the equal condition with no left side yet. it is bound to
+// the other conditions by parse_conditions, and finds nothing if it is not.
+int Searcher::parse_conditions_exclusion
+(JsonValue* val, std::string attr_name, AttrDataType attr_type) {
+  int excluded = -1;
+  if(attr_type.fulltext_flag) {
+    excluded = parse_conditions_fulltext(val->get_value_by_index(2), attr_name, attr_type);
+  } else {
+    SearchNode n = {SEARCH_NODE_TYPE_LEAF, -1, -1, -1, false};
+    SearchCache c = {SEARCH_CACHE_TYPE_EQUAL, NULL, NULL};
+    c.phrase1 = parse_conditions_index(attr_name, attr_type, val->get_value_by_index(2));
+    caches.push_back(c);
+    n.cache = caches.size()-1;
+    nodes.push_back(n);
+    excluded = nodes.size()-1;
+  }
+
+  SearchNode n = {SEARCH_NODE_TYPE_ANDNOT, -1, -1, excluded, false};
+  nodes.push_back(n);
+
+  return nodes.size()-1;
+}
+
+
 int Searcher::parse_conditions_fulltext
 (JsonValue* val, std::string attr_name, AttrDataType attr_type) {
-  if(!val || val->get_value_type() != json_string)  return -1;
-  MorphController m;
+  if(!val || val->get_value_type() != json_string || !morph)  return -1;
   WORD_SET p; 
   std::string word = val->get_string_value();
-  m.get_search_phrases(word.c_str(), p, MAX_PHRASE_LENGTH);
+  morph->get_search_phrases(word.c_str(), p, MAX_PHRASE_LENGTH);
 
   int prev_node = -1;
   bool pos_check = true;
@@ -267,62 +371,253 @@ char* Searcher::parse_conditions_index(std::string attr_name, AttrDataType attr_
 
 
 int Searcher::do_search(SEARCH_HIT_DATA_SET& result) {
+  unsigned short the_sector = data.document_data.get_next_addr().sector;
+  if(search_threads > 1 && the_sector > 0) return do_search_parallel(result, the_sector);
+
   int hit_count = 0;
   setup_cache();
-  setup_node();
+  plan_node(root_node);
+  clear_iterators();
+
+  // counting without phrases works on whole sets of document offsets
+  if(count_only && is_set_node(root_node)) {
+    SECTOR_OFFSET_MAP docs;
+    count_set(root_node, docs);
+    for(SECTOR_OFFSET_MAP::iterator it=docs.begin(); it!=docs.end(); ++it) {
+      for(unsigned int i=0; facet_names.size() > 0 && i<it->second.size() && hit_count+(int)i < max_count; i++) {
+        DocumentAddr addr = {it->first, it->second[i]};
+        count_facets(addr);
+      }
+      hit_count += it->second.size();
+    }
+    set_facet_counts();
+    if(hit_count > max_count) {
+      count_exact = false;
+      hit_count = max_count;
+    }
+    return hit_count;
+  }
+
+  root_iterator = build_iterator(root_node);
 
-  SearchHitData hit_data;
+  // with a cursor, hits up to the cursor are skipped by seeking and not counted
+  bool seeked = cursor.empty;
+  int  skipped = 0;
+  SearchHitData hit_data = cursor;
   for(int i=0; i<offset+limit; i++) {
     while(1) {
-      hit_data = pickup_hit(root_node);
-      if(result.size() == 0 || hit_data.empty || search_hit_data_comp_weak(hit_data, result[result.size()-1]) != 0)  break;
+      hit_data = next_hit(seeked, skipped);
+      SearchHitData& last = result.size() ? result[result.size()-1] : cursor;
+      if(hit_data.empty || search_hit_data_comp_weak(hit_data, last) != 0)  break;
     }
     if(hit_data.empty) break;
     result.push_back(hit_data);
     hit_count++;
+    if(facet_names.size() > 0) count_facets(hit_document_addr(hit_data));
   }
 
-  if(lazy_count) {
+  if(lazy_count && seeked) {
     int guess_count = 0;
     int total = 0;
-    int current = 0;
-    for(int i=0; i<(int)caches.size(); i++) {
-      for(int j=0; j<(int)caches[i].partials.size(); j++) {
-        for(int k=0; k<(int)caches[i].partials[j].ranges.size(); k++) {
-          SearchResultRange& r = caches[i].partials[j].ranges[k];
-          SearchPartial&     p = caches[i].partials[j];
-          total = total + r.right_offset-r.left_offset+1;
-          if(k==p.next_range-1 && p.hits.size() > 0) {
-            current = current + ((r.right_offset-r.left_offset+1)*p.next_hit)/p.hits.size();  
-          } else if(k<p.next_range-1) {
-            current = current + (r.right_offset-r.left_offset+1);
-          }
-        }
-      }
-    }
+    int current = search_progress(total);
 
+    total   = total - skipped;
+    current = current - skipped;
     if(current < 0)  current = 0;
     if(current < 20) current = current + 2;
 
     guess_count = (hit_count * total)/current;
     if(guess_count > 1000) {
+      count_exact = false;
       return guess_count;
     }
   }
 
   SearchHitData prev_hit = hit_data;
   while(1) {
-    hit_data = pickup_hit(root_node);
+    hit_data = next_hit(seeked, skipped);
     if(hit_data.empty) break;
     if(search_hit_data_comp_weak(hit_data, prev_hit) != 0) {
+      if(hit_count >= max_count) {
+        count_exact = false;
+        break;
+      }
       hit_count++;
       prev_hit = hit_data;
+      if(facet_names.size() > 0) count_facets(hit_document_addr(hit_data));
     }
   }
+  set_facet_counts();
 
   return hit_count; 
 }
 
+
+// the sectors are divided among the workers, each searches its sectors
+// with a copy of the parsed request and the results are merged.
+// documents belong to one sector, so the counts are added up.
+int Searcher::do_search_parallel(SEARCH_HIT_DATA_SET& result, unsigned short the_sector) {
+  int sectors = the_sector + 1;
+  int n = search_threads < sectors ? search_threads : sectors;
+  while((int)workers.size() < n) {
+    workers.push_back(new Searcher(path, log_file, attrs, shm, morph));
+  }
+
+  std::vector<pthread_t> threads(n);
+  std::vector<bool>      started(n, false);
+  for(int k=0; k<n; k++) {
+    Searcher* w = workers[k];
+    w->init();
+    w->offset      = offset;
+    w->limit       = limit;
+    w->count_only  = count_only;
+    w->exact_count = exact_count;
+    w->lazy_count  = lazy_count;
+    w->max_count   = max_count;
+    w->cursor      = cursor;
+    w->nodes       = nodes;
+    w->caches      = caches;  // phrases are in this searcher's buffer
+    w->order       = order;
+    w->facet_names = facet_names;
+    w->facet_types = facet_types;
+    w->root_node   = root_node;
+    w->sector_from = (unsigned short)(k*sectors/n);
+    w->sector_to   = (unsigned short)((k+1)*sectors/n - 1);
+    w->worker_result.clear();
+    w->worker_count = 0;
+    w->worker_error = false;
+    started[k] = (pthread_create(&threads[k], NULL, search_worker, w) == 0);
+    if(!started[k]) search_worker(w);
+  }
+
+  bool error = false;
+  int hit_count = 0;
+  count_exact = true;
+  set_facet_counts();
+  for(int k=0; k<n; k++) {
+    if(started[k]) pthread_join(threads[k], NULL);
+    error = error || workers[k]->worker_error;
+    hit_count += workers[k]->worker_count;
+    count_exact = count_exact && workers[k]->count_exact;
+
+    FACET_COUNT_MAP& wf = workers[k]->facet_counts;
+    for(FACET_COUNT_MAP::iterator f=wf.begin(); f!=wf.end(); ++f) {
+      for(std::map<std::string, int>::iterator v=f->second.begin(); v!=f->second.end(); ++v) {
+        facet_counts[f->first][v->first] += v->second;
+      }
+    }
+  }
+  if(error) throw AppException(EX_APP_SEARCHER, "sector search failed");
+  if(hit_count > max_count) {
+    hit_count = max_count;
+    count_exact = false;
+  }
+
+  // each result is sorted, take the first offset+limit hits of them
+  std::vector<unsigned int> next(n, 0);
+  while((int)result.size() < offset+limit) {
+    int pick = -1;
+    for(int k=0; k<n; k++) {
+      SEARCH_HIT_DATA_SET& r = workers[k]->worker_result;
+      if(next[k] >= r.size()) continue;
+      if(pick < 0 || search_hit_data_comp(r[next[k]], workers[pick]->worker_result[next[pick]]) < 0) pick = k;
+    }
+    if(pick < 0) break;
+    result.push_back(workers[pick]->worker_result[next[pick]]);
+    next[pick]++;
+  }
+
+  return hit_count;
+}
+
+
+void* Searcher::search_worker(void* p) {
+  Searcher* w = (Searcher*)p;
+  try {
+    w->worker_count = w->do_search(w->worker_result);
+  } catch(AppException e) {
+    write_log(LOG_LEVEL_ERROR, e.what(), w->log_file);
+    w->worker_error = true;
+  }
+  w->finish();
+
+  return NULL;
+}
+
+
+// next hit of the root node. the first call with a cursor seeks to it,
+// and the postings passed by the seek are returned as skipped
+SearchHitData Searcher::next_hit(bool& seeked, int& skipped) {
+  SearchHitData empty = {true, 0, {0, 0, 0, 0}, 0};
+  const SearchHitData* hit_data;
+  if(seeked) {
+    hit_data = root_iterator->next();
+  } else {
+    int total;
+    hit_data = root_iterator->seek(cursor);
+    seeked  = true;
+    skipped = search_progress(total);
+  }
+
+  return hit_data ? *hit_data : empty;
+}
+
+
+// postings read so far, estimated from the position in each range
+int Searcher::search_progress(int& total) {
+  int current = 0;
+  total = 0;
+  for(int i=0; i<(int)caches.size(); i++) {
+    for(int j=0; j<(int)caches[i].partials.size(); j++) {
+      for(int k=0; k<(int)caches[i].partials[j].ranges.size(); k++) {
+        SearchResultRange& r = caches[i].partials[j].ranges[k];
+        SearchPartial&     p = caches[i].partials[j];
+        total = total + r.right_offset-r.left_offset+1;
+        if(k==p.next_range-1 && p.hits.size() > 0) {
+          current = current + ((r.right_offset-r.left_offset+1)*p.next_hit)/p.hits.size();  
+        } else if(k<p.next_range-1) {
+          current = current + (r.right_offset-r.left_offset+1);
+        }
+      }
+    }
+  }
+
+  return current;
+}
+
+
+// cursor is the hex of the sortkeys and the id of a hit
+std::string Searcher::make_cursor(SearchHitData& h) {
+  char buf[(SORT_KEY_COUNT+1)*8+1];
+  for(int i=0; i<SORT_KEY_COUNT; i++) {
+    sprintf(buf+i*8, "%08x", h.sortkey[i]);
+  }
+  sprintf(buf+SORT_KEY_COUNT*8, "%08x", h.id);
+
+  return std::string(buf);
+}
+
+
+bool Searcher::parse_cursor(JsonValue* val) {
+  if(!val) return true;
+  if(val->get_value_type() != json_string) return false;
+
+  std::string str = val->get_string_value();
+  if(str == "") return true;  // first page
+  if(str.size() != (SORT_KEY_COUNT+1)*8) return false;
+  if(str.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) return false;
+
+  SearchHitData h = {false, 0, {0, 0, 0, 0}, 0};
+  for(int i=0; i<=SORT_KEY_COUNT; i++) {
+    unsigned int v = strtoul(str.substr(i*8, 8).c_str(), NULL, 16);
+    if(i < SORT_KEY_COUNT) h.sortkey[i] = v;
+    else                   h.id = v;
+  }
+  cursor = h;
+
+  return true;
+}
+
 bool Searcher::search(JsonValue* request_obj, JsonValue* return_obj, AppConfig& cfg) {
   SEARCH_HIT_DATA_SET result;
 
@@ -354,56 +649,40 @@ bool Searcher::search(JsonValue* request_obj, JsonValue* return_obj, AppConfig&
 }
 
 
-void Searcher::setup_node() {
-  for(unsigned int i=0; i<nodes.size(); i++) {
-    nodes[i].left_hit_cache.empty = true;
-    nodes[i].right_hit_cache.empty = true;
-  }
-}
-
-
 void Searcher::setup_cache() {
+  // ordered hits are sorted by TermIterator as they are picked up
   for(unsigned int i=0; i<caches.size(); i++) {
-    SearchPartial p = {0, 0};
+    SearchPartial p = {0, 0, 0};
 
     unsigned short the_sector = data.document_data.get_next_addr().sector;
 
-    if(caches[i].search_type == SEARCH_CACHE_TYPE_EQUAL && order.size() == 0) {
-      for(unsigned short s=0; s<=the_sector; s++) {
+    // hits of each range are loaded when the range is reached
+    if(caches[i].search_type == SEARCH_CACHE_TYPE_EQUAL && order.size() == 0 && !count_only) {
+      for(unsigned short s=sector_from; s<=the_sector && s<=sector_to; s++) {
         caches[i].partials.push_back(p);
-        data.reverse_index.find_range(caches[i].phrase1, caches[i].partials[s].ranges, s);
-        data.reverse_index.find_hit_data_partial(caches[i].partials[s].hits, caches[i].partials[s].ranges, 0, order);
-        caches[i].partials[s].next_range = 1;
+        data.reverse_index.find_range(caches[i].phrase1, caches[i].partials.back().ranges, s);
       }
     }
     else if(caches[i].search_type == SEARCH_CACHE_TYPE_EQUAL) {
       caches[i].partials.push_back(p);
-      for(unsigned short s=0; s<=the_sector; s++) {
+      for(unsigned short s=sector_from; s<=the_sector && s<=sector_to; s++) {
         data.reverse_index.find_range(caches[i].phrase1, caches[i].partials[0].ranges, s);
       }
-      data.reverse_index.find_hit_data_all(caches[i].partials[0].hits, caches[i].partials[0].ranges, order);
-
-      sort(caches[i].partials[0].hits.begin(), caches[i].partials[0].hits.end(), SearchHitDataComp());
-      caches[i].partials[0].next_range = caches[i].partials[0].ranges.size();
+      load_hits(caches[i].partials[0]);
     }
     else if(caches[i].search_type == SEARCH_CACHE_TYPE_PREFIX) {
       caches[i].partials.push_back(p);
-      for(unsigned short s=0; s<=the_sector; s++) {
+      for(unsigned short s=sector_from; s<=the_sector && s<=sector_to; s++) {
         data.reverse_index.find_prefix_range(caches[i].phrase1, caches[i].partials[0].ranges, s);
       }
-      data.reverse_index.find_hit_data_all(caches[i].partials[0].hits, caches[i].partials[0].ranges, order);
-
-      sort(caches[i].partials[0].hits.begin(), caches[i].partials[0].hits.end(), SearchHitDataComp());
-      caches[i].partials[0].next_range = caches[i].partials[0].ranges.size();
+      load_hits(caches[i].partials[0]);
     }
     else if(caches[i].search_type == SEARCH_CACHE_TYPE_BETWEEN) {
       caches[i].partials.push_back(p);
-      for(unsigned short s=0; s<=the_sector; s++) {
+      for(unsigned short s=sector_from; s<=the_sector && s<=sector_to; s++) {
         data.reverse_index.find_between_range(caches[i].phrase1, caches[i].phrase2, caches[i].partials[0].ranges, s);
       }
-      data.reverse_index.find_hit_data_all(caches[i].partials[0].hits, caches[i].partials[0].ranges, order);
-      sort(caches[i].partials[0].hits.begin(), caches[i].partials[0].hits.end(), SearchHitDataComp());
-      caches[i].partials[0].next_range = caches[i].partials[0].ranges.size();
+      load_hits(caches[i].partials[0]);
     }
     else {
       continue;
@@ -412,104 +691,331 @@ void Searcher::setup_cache() {
 }
 
 
+// all hits of the ranges at once, in sortkey order or, when only counting,
+// in document address order which needs no document read
+void Searcher::load_hits(SearchPartial& p) {
+  if(count_only) {
+    data.reverse_index.find_addr_data_all(p.hits, p.ranges);
+  } else {
+    data.reverse_index.find_hit_data_all(p.hits, p.ranges, order);
+  }
+  p.next_range = p.ranges.size();
+}
 
-SearchHitData Searcher::pickup_hit(int node_id) {
-  SearchHitData empty = {true, 0, {0, 0, 0, 0}, 0};
-  if(node_id < 0 || node_id >= (int)nodes.size()) return empty;
+
+
+// postings of the node estimated from the ranges of its leaves, the node is not changed.
+// AND is the rarest side and OR the sum of both, ANDNOT is its left side.
+int Searcher::estimate_node(int node_id) {
+  if(node_id < 0 || node_id >= (int)nodes.size()) return 0;
 
   SearchNode& n = nodes[node_id];
-  SearchHitData hit_data = empty;
   if(n.type == SEARCH_NODE_TYPE_LEAF) {
-    n.left_hit_cache = n.right_hit_cache = pickup_cache(n.cache);
-    return n.left_hit_cache;
-  } else if(n.left_node == -1) {
-    hit_data = pickup_hit(n.right_node);
-  } else if(n.right_node == -1) {
-    hit_data = pickup_hit(n.left_node);
-  } else if(n.type == SEARCH_NODE_TYPE_AND) { 
-    if(n.left_hit_cache.empty)  n.left_hit_cache = pickup_hit(n.left_node);
-    if(n.right_hit_cache.empty) n.right_hit_cache = pickup_hit(n.right_node);
+    int estimate = 0;
+    if(n.cache < 0 || n.cache >= (int)caches.size()) return 0;
+    for(unsigned int i=0; i<caches[n.cache].partials.size(); i++) {
+      SEARCH_RESULT_RANGE_SET& ranges = caches[n.cache].partials[i].ranges;
+      for(unsigned int j=0; j<ranges.size(); j++) {
+        if(ranges[j].pageno >= 0 && ranges[j].right_offset >= ranges[j].left_offset) {
+          estimate += ranges[j].right_offset - ranges[j].left_offset + 1;
+        }
+      }
+    }
+    return estimate;
+  }
+  if(n.type == SEARCH_NODE_TYPE_ANDNOT) {
+    return n.left_node < 0 ? 0 : estimate_node(n.left_node);
+  }
+  if(n.type != SEARCH_NODE_TYPE_AND && n.type != SEARCH_NODE_TYPE_OR) return 0;
 
-    while(1) {
-      if(n.left_hit_cache.empty || n.right_hit_cache.empty) return empty;
+  int left = estimate_node(n.left_node), right = estimate_node(n.right_node);
+  if(n.left_node < 0)  return right;
+  if(n.right_node < 0) return left;
+  if(n.type == SEARCH_NODE_TYPE_OR) return left + right;
+  return left < right ? left : right;
+}
 
-      int cmp = search_hit_data_comp_weak(n.left_hit_cache, n.right_hit_cache);
-      if(cmp == 0 && n.pos_check && n.left_hit_cache.pos - n.right_hit_cache.pos != 1) {
-        cmp = n.left_hit_cache.pos - n.right_hit_cache.pos;
-      }
- 
-      if(cmp == 0) {
-        hit_data = n.left_hit_cache;
-        n.left_hit_cache.empty = true;
-        n.right_hit_cache.empty = true;
-        break;
-      } else if(cmp < 0) {
-        n.left_hit_cache = pickup_hit(n.left_node);
-      } else {
-        n.right_hit_cache = pickup_hit(n.right_node);
+
+// estimate_node, and AND/OR chains below the node are flattened and rebuilt:
+// empty operands are dropped and AND operands are joined rarest first, so that
+// the rarest leaf leads the seeks. a phrase(pos_check) node and everything below
+// it are kept as they are, as the phrase check depends on the order of its sides.
+// an ANDNOT node is estimated by its left side, an empty right side is dropped.
+int Searcher::plan_node(int node_id) {
+  if(node_id < 0 || node_id >= (int)nodes.size()) return 0;
+
+  SearchNode& n = nodes[node_id];
+  if(n.type == SEARCH_NODE_TYPE_LEAF || (n.type == SEARCH_NODE_TYPE_AND && n.pos_check)) {
+    return estimate_node(node_id);
+  }
+  if(n.type == SEARCH_NODE_TYPE_ANDNOT) {
+    int left = plan_node(n.left_node);
+    if(left == 0) {
+      nodes[node_id].left_node = nodes[node_id].right_node = -1;
+      return 0;
+    }
+    if(plan_node(n.right_node) == 0) nodes[node_id].right_node = -1;
+    return left;
+  }
+  if(n.type != SEARCH_NODE_TYPE_AND && n.type != SEARCH_NODE_TYPE_OR) return 0;
+
+  std::vector<int> chain, operands;
+  chain.push_back(node_id);
+  for(unsigned int i=0; i<chain.size(); i++) {
+    int child[2] = {nodes[chain[i]].left_node, nodes[chain[i]].right_node};
+    for(int j=0; j<2; j++) {
+      if(child[j] < 0 || child[j] >= (int)nodes.size()) continue;
+      SearchNode& c = nodes[child[j]];
+      if(c.type == n.type && !c.pos_check) chain.push_back(child[j]);
+      else                                 operands.push_back(child[j]);
+    }
+  }
+
+  int estimate = 0;
+  std::vector<std::pair<int, int> > planned;  // estimate, node
+  for(unsigned int i=0; i<operands.size(); i++) {
+    int e = plan_node(operands[i]);
+    if(e == 0 && n.type == SEARCH_NODE_TYPE_AND) {
+      nodes[node_id].left_node = nodes[node_id].right_node = -1;
+      return 0;
+    }
+    if(e == 0) continue;
+    planned.push_back(std::make_pair(e, operands[i]));
+    if(n.type == SEARCH_NODE_TYPE_OR)                     estimate += e;
+    else if(planned.size() == 1 || e < estimate)          estimate = e;
+  }
+  if(n.type == SEARCH_NODE_TYPE_AND) std::stable_sort(planned.begin(), planned.end());
+
+  // left-deep chain on the collected nodes, the first operands at the bottom
+  int current = -1;
+  for(unsigned int i=0; i<planned.size(); i++) {
+    if(current < 0 && i+1 < planned.size()) {
+      current = planned[i].second;
+      continue;
+    }
+    int id = chain[chain.size()-1 - (i > 0 ? i-1 : 0)];
+    if(i+1 == planned.size()) id = node_id;
+    nodes[id].left_node  = current;
+    nodes[id].right_node = planned[i].second;
+    current = id;
+  }
+  if(planned.size() == 0) nodes[node_id].left_node = nodes[node_id].right_node = -1;
+
+  return estimate;
+}
+
+
+// true if the node has no phrase(pos_check) node and can be counted by count_set
+bool Searcher::is_set_node(int node_id) {
+  if(node_id < 0 || node_id >= (int)nodes.size()) return true;
+
+  SearchNode& n = nodes[node_id];
+  if(n.type == SEARCH_NODE_TYPE_LEAF) return true;
+  if(n.type == SEARCH_NODE_TYPE_AND && n.pos_check && n.left_node != -1 && n.right_node != -1) return false;
+  return is_set_node(n.left_node) && is_set_node(n.right_node);
+}
+
+
+// documents of the node as sorted offsets per sector, joined by SetKernel.
+// the node is read as build_iterator reads it.
+void Searcher::count_set(int node_id, SECTOR_OFFSET_MAP& docs) {
+  if(node_id < 0 || node_id >= (int)nodes.size()) return;
+
+  SearchNode& n = nodes[node_id];
+  if(n.type == SEARCH_NODE_TYPE_LEAF) {
+    if(n.cache < 0 || n.cache >= (int)caches.size()) return;
+    SEARCH_PARTIAL_SET& partials = caches[n.cache].partials;
+    for(unsigned int i=0; i<partials.size(); i++) {
+      for(unsigned int j=0; j<partials[i].hits.size(); j++) {
+        docs[partials[i].hits[j].sortkey[0]].push_back(partials[i].hits[j].sortkey[1]);
       }
     }
-  } else if(n.type == SEARCH_NODE_TYPE_OR) {
-    if(n.left_hit_cache.empty)  n.left_hit_cache = pickup_hit(n.left_node);
-    if(n.right_hit_cache.empty) n.right_hit_cache = pickup_hit(n.right_node);
-
-    if(n.left_hit_cache.empty && n.right_hit_cache.empty) return empty;
-    int cmp = search_hit_data_comp_weak(n.left_hit_cache, n.right_hit_cache);
-    if(cmp == 0) {
-      hit_data = n.left_hit_cache;
-      n.left_hit_cache.empty = true;
-      n.right_hit_cache.empty = true;
-    } else if(cmp < 0) {
-      hit_data = n.left_hit_cache;
-      n.left_hit_cache.empty = true;
+    for(SECTOR_OFFSET_MAP::iterator it=docs.begin(); it!=docs.end(); ++it) {
+      std::sort(it->second.begin(), it->second.end());
+      it->second.erase(std::unique(it->second.begin(), it->second.end()), it->second.end());
+    }
+    return;
+  }
+  if(n.type == SEARCH_NODE_TYPE_ANDNOT) {
+    if(n.left_node == -1) return;
+    count_set(n.left_node, docs);
+    if(n.right_node == -1 || docs.size() == 0) return;
+
+    SECTOR_OFFSET_MAP excluded;
+    count_set(n.right_node, excluded);
+    for(SECTOR_OFFSET_MAP::iterator e=excluded.begin(); e!=excluded.end(); ++e) {
+      SECTOR_OFFSET_MAP::iterator d = docs.find(e->first);
+      if(d == docs.end()) continue;
+      unsigned int size = SetKernel::subtract(&d->second[0], d->second.size(), &e->second[0], e->second.size(), &d->second[0]);
+      d->second.resize(size);
+      if(size == 0) docs.erase(d);
+    }
+    return;
+  }
+  if(n.left_node == -1)  return count_set(n.right_node, docs);
+  if(n.right_node == -1) return count_set(n.left_node, docs);
+  if(n.type != SEARCH_NODE_TYPE_AND && n.type != SEARCH_NODE_TYPE_OR) return;
+
+  SECTOR_OFFSET_MAP left, right;
+  count_set(n.left_node, left);
+  if(n.type == SEARCH_NODE_TYPE_AND && left.size() == 0) return;
+  count_set(n.right_node, right);
+
+  SECTOR_OFFSET_MAP::iterator l = left.begin(), r = right.begin();
+  while(l != left.end() || r != right.end()) {
+    if(r == right.end() || (l != left.end() && l->first < r->first)) {
+      if(n.type == SEARCH_NODE_TYPE_OR) docs[l->first].swap(l->second);
+      ++l;
+    } else if(l == left.end() || r->first < l->first) {
+      if(n.type == SEARCH_NODE_TYPE_OR) docs[r->first].swap(r->second);
+      ++r;
     } else {
-      hit_data = n.right_hit_cache;
-      n.right_hit_cache.empty = true;
+      std::vector<unsigned int>& a = l->second;
+      std::vector<unsigned int>& b = r->second;
+      std::vector<unsigned int> joined(n.type == SEARCH_NODE_TYPE_OR ? a.size()+b.size() : std::min(a.size(), b.size()));
+      unsigned int size = 0;
+      if(joined.size() > 0) {
+        if(n.type == SEARCH_NODE_TYPE_OR) size = SetKernel::unite(&a[0], a.size(), &b[0], b.size(), &joined[0]);
+        else                              size = SetKernel::intersect(&a[0], a.size(), &b[0], b.size(), &joined[0]);
+      }
+      joined.resize(size);
+      if(size > 0) docs[l->first].swap(joined);
+      ++l, ++r;
     }
   }
+}
+
 
-  return hit_data;
+// count_only hits have the document address in place of the sortkeys
+DocumentAddr Searcher::hit_document_addr(const SearchHitData& hit) {
+  if(!count_only) return data.document.find_addr_by_id(hit.id);
+
+  DocumentAddr addr = {(unsigned short)hit.sortkey[0], hit.sortkey[1]};
+  return addr;
 }
 
 
-void Searcher::clear_current_hit(int node_id) {
-  if(node_id < 0 || node_id >= (int)nodes.size()) return;
+// tally the facet phrases of the document, each phrase is classified once per request
+void Searcher::count_facets(DocumentAddr addr) {
+  PHRASE_ADDR_SET phrases;
+  data.regular_index.find(addr, phrases);
 
-  nodes[node_id].left_hit_cache.empty = true;
-  nodes[node_id].right_hit_cache.empty = true;
-  clear_current_hit(nodes[node_id].left_node);
-  clear_current_hit(nodes[node_id].right_node);
+  std::vector<std::pair<unsigned short, unsigned int> > keys;
+  for(unsigned int i=0; i<phrases.size(); i++) {
+    keys.push_back(std::make_pair(phrases[i].sector, phrases[i].offset));
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+  for(unsigned int i=0; i<keys.size(); i++) {
+    PHRASE_COUNT_MAP::iterator it = facet_phrases.find(keys[i]);
+    if(it == facet_phrases.end()) {
+      PhraseAddr p = {keys[i].first, keys[i].second};
+      std::string value;
+      it = facet_phrases.insert(std::make_pair(keys[i], facet_value(p, value))).first;
+    }
+    if(it->second >= 0) facet_hits[keys[i]]++;
+  }
 }
 
 
-SearchHitData Searcher::pickup_cache(int cache_id) {
-  SearchHitData empty = {true, 0, {0, 0, 0}, 0};
-  if(cache_id < 0 || cache_id >= (int)caches.size()) return empty;
+// facet of the phrase and its value, -1 if the phrase is not of a facet attribute
+int Searcher::facet_value(PhraseAddr addr, std::string& value) {
+  PhraseData d = data.phrase.find_data(addr, buf);
+  if(!d.value) return -1;
 
-  SearchHitData hit_data = empty;
-  int pickup_index = -1;
-  for(unsigned int i=0; i<caches[cache_id].partials.size(); i++) {
-    SearchPartial&  p = caches[cache_id].partials[i];
-    if(p.ranges.size() == 0) continue;
+  for(unsigned int i=0; i<facet_types.size(); i++) {
+    if((unsigned char)d.value[0] != facet_types[i].header) continue;
 
-    if(p.next_hit >= (int)p.hits.size()) {
-      p.hits.clear();
-      if(p.next_range >= (int)p.ranges.size()) continue;
-      data.reverse_index.find_hit_data_partial(p.hits, p.ranges, p.next_range, order);
-      p.next_hit = 0;
-      p.next_range++;
+    if(!IS_ATTR_TYPE_STRING(d.value[0])) {
+      int x;
+      char str[16];
+      memcpy(&x, d.value+1, sizeof(int));
+      sprintf(str, "%d", x);
+      value = str;
+      return i;
     }
-    if(p.hits.size() == 0) continue;
+    if(facet_types[i].index_flag) {
+      value = d.value+1;
+      return i;
+    }
+
+    // phrases of attributes not registered have the name in them
+    std::string prefix = facet_names[i] + "\t";
+    if(strncmp(d.value+1, prefix.c_str(), prefix.length()) == 0) {
+      value = d.value+1+prefix.length();
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+
+void Searcher::set_facet_counts() {
+  facet_counts.clear();
+  for(unsigned int i=0; i<facet_names.size(); i++) {
+    facet_counts[facet_names[i]];
+  }
+
+  for(PHRASE_COUNT_MAP::iterator it=facet_hits.begin(); it!=facet_hits.end(); ++it) {
+    PhraseAddr p = {it->first.first, it->first.second};
+    std::string value;
+    int facet = facet_value(p, value);
+    if(facet >= 0) facet_counts[facet_names[facet]][value] += it->second;
+  }
+}
+
 
-    if(search_hit_data_comp(hit_data, p.hits[p.next_hit]) > 0) {
-      hit_data = p.hits[p.next_hit];
-      pickup_index = i;
+// iterators for the node and its children, owned by the searcher
+SearchIterator* Searcher::build_iterator(int node_id) {
+  SearchIterator* it = NULL;
+  if(node_id < 0 || node_id >= (int)nodes.size()) {
+    it = new EmptyIterator();
+  } else {
+    SearchNode& n = nodes[node_id];
+    if(n.type == SEARCH_NODE_TYPE_LEAF) {
+      if(n.cache >= 0 && n.cache < (int)caches.size()) it = new TermIterator(caches[n.cache], data.reverse_index, order);
+      else                                               it = new EmptyIterator();
+    } else if(n.type == SEARCH_NODE_TYPE_ANDNOT) {
+      if(n.left_node == -1) {
+        it = new EmptyIterator();
+      } else if(n.right_node == -1) {
+        return build_iterator(n.left_node);
+      } else {
+        SearchIterator* l = build_iterator(n.left_node);
+        SearchIterator* r = build_iterator(n.right_node);
+        it = new AndNotIterator(l, r);
+      }
+    } else if(n.left_node == -1) {
+      return build_iterator(n.right_node);
+    } else if(n.right_node == -1) {
+      return build_iterator(n.left_node);
+    } else if(n.type == SEARCH_NODE_TYPE_AND) {
+      SearchIterator* l = build_iterator(n.left_node);
+      SearchIterator* r = build_iterator(n.right_node);
+      if(n.pos_check) it = new PhraseIterator(l, r);
+      else            it = new AndIterator(l, r);
+    } else if(n.type == SEARCH_NODE_TYPE_OR) {
+      SearchIterator* l = build_iterator(n.left_node);
+      SearchIterator* r = build_iterator(n.right_node);
+      it = new OrIterator(l, r);
+    } else {
+      it = new EmptyIterator();
     }
   }
-  if(pickup_index < 0) return empty;
 
-  caches[cache_id].partials[pickup_index].next_hit++;
-  return hit_data;
+  iterators.push_back(it);
+  return it;
+}
+
+
+void Searcher::clear_iterators() {
+  for(unsigned int i=0; i<iterators.size(); i++) {
+    delete iterators[i];
+  }
+  iterators.clear();
+  root_iterator = NULL;
 }
 
 
@@ -576,7 +1082,7 @@ bool Searcher::test() {
     delete val;
     lazy_count = false;
     hits.clear();
-    hit_count = do_search(hits); 
+    hit_count = do_search(hits);
     if(hit_count != 0 || hits.size() != 0) throw AppException(EX_APP_SEARCHER, "");
   
   
@@ -588,12 +1094,85 @@ bool Searcher::test() {
     delete val;
     lazy_count = false;
     hits.clear();
-    hit_count = do_search(hits); 
+    hit_count = do_search(hits);
     if(hit_count != 1 + 3000/70) throw AppException(EX_APP_SEARCHER, "");
     for(unsigned int i=0; i<hits.size(); i++) {
       if(hits[i].id % 70 != 0) throw AppException(EX_APP_SEARCHER, "");
     }
   
+    std::cout << "AND-search request with an empty condition...\n";
+    request_str = "{\"offset\":0, \"limit\":10, \"conditions\":[[\"title\", \"equal\", \"p000099\"], [\"title\", \"equal\", \"x000000\"]]}";
+    val = JsonImport::json_import(request_str); 
+    init();
+    parse_request(val, cfg);
+    delete val;
+    lazy_count = false;
+    hits.clear();
+    hit_count = do_search(hits);
+    if(hit_count != 0 || hits.size() != 0) throw AppException(EX_APP_SEARCHER, "");
+    for(unsigned int i=0; i<caches.size(); i++) {
+      for(unsigned int j=0; j<caches[i].partials.size(); j++) {
+        if(caches[i].partials[j].next_range != 0) throw AppException(EX_APP_SEARCHER, "");
+      }
+    }
+
+    std::cout << "not_equal request...\n";
+    request_str = "{\"offset\":0, \"limit\":3000, \"conditions\":[[\"title\", \"not_equal\", \"p000001\"], [\"title\", \"equal\", \"p000099\"]]}";
+    val = JsonImport::json_import(request_str); 
+    init();
+    parse_request(val, cfg);
+    delete val;
+    lazy_count = false;
+    hits.clear();
+    hit_count = do_search(hits);
+    if(hit_count != 3000 - 3000/10 || hits.size() != 3000 - 3000/10) throw AppException(EX_APP_SEARCHER, "");
+    for(unsigned int i=0; i<hits.size(); i++) {
+      if(hits[i].id % 10 == 1) throw AppException(EX_APP_SEARCHER, "");
+    }
+
+    request_str = "{\"count_only\":true, \"conditions\":[[\"title\", \"not_equal\", \"p000001\"], [\"title\", \"equal\", \"p000099\"]]}";
+    val = JsonImport::json_import(request_str); 
+    init();
+    parse_request(val, cfg);
+    delete val;
+    hits.clear();
+    if(do_search(hits) != 3000 - 3000/10) throw AppException(EX_APP_SEARCHER, "");
+
+    request_str = "{\"offset\":0, \"limit\":10, \"conditions\":[\"title\", \"not_equal\", \"p000001\"]}";
+    val = JsonImport::json_import(request_str); 
+    init();
+    parse_request(val, cfg);
+    delete val;
+    hits.clear();
+    if(do_search(hits) != 0 || hits.size() != 0) throw AppException(EX_APP_SEARCHER, "");
+
+    std::cout << "facets request...\n";
+    request_str = "{\"offset\":0, \"limit\":10, \"conditions\":[\"title\", \"equal\", \"p000001\"], \"facets\":[\"title\"]}";
+    val = JsonImport::json_import(request_str); 
+    init();
+    if(!parse_request(val, cfg)) throw AppException(EX_APP_SEARCHER, "");
+    delete val;
+    hits.clear();
+    if(do_search(hits) != 3000/10) throw AppException(EX_APP_SEARCHER, "");
+    if(facet_counts["title"]["p000099"] != 300 || facet_counts["title"]["p000021"] != 100 ||
+       facet_counts["title"].count("p000020") != 0) throw AppException(EX_APP_SEARCHER, "");
+    if(facet_counts["title"].size() != 1 + 7 + 3 + 300*20 + 1) throw AppException(EX_APP_SEARCHER, "");
+
+    request_str = "{\"count_only\":true, \"conditions\":[\"title\", \"equal\", \"p000001\"], \"facets\":[\"title\"]}";
+    val = JsonImport::json_import(request_str); 
+    init();
+    if(!parse_request(val, cfg)) throw AppException(EX_APP_SEARCHER, "");
+    delete val;
+    hits.clear();
+    if(do_search(hits) != 3000/10) throw AppException(EX_APP_SEARCHER, "");
+    if(facet_counts["title"]["p000099"] != 300 || facet_counts["title"]["p000021"] != 100) throw AppException(EX_APP_SEARCHER, "");
+
+    request_str = "{\"conditions\":[\"title\", \"equal\", \"p000001\"], \"facets\":[\"content\"]}";
+    val = JsonImport::json_import(request_str); 
+    init();
+    if(parse_request(val, cfg)) throw AppException(EX_APP_SEARCHER, "");
+    delete val;
+
     std::cout << "OR-search request...\n";
     request_str = "{\"offset\":0, \"limit\":3000, \"conditions\":[[[\"title\", \"equal\", \"p000001\"], [\"title\", \"equal\", \"p000002\"], [\"title\", \"equal\", \"p000003\"]]]}";
     val = JsonImport::json_import(request_str); 
@@ -602,7 +1181,7 @@ bool Searcher::test() {
     delete val;
     lazy_count = false;
     hits.clear();
-    hit_count = do_search(hits); 
+    hit_count = do_search(hits);
   
     if(hit_count != (3000/10)*3) throw AppException(EX_APP_SEARCHER, "");
     for(unsigned int i=0; i<hits.size(); i++) {
@@ -619,7 +1198,7 @@ bool Searcher::test() {
     delete val;
     lazy_count = false;
     hits.clear();
-    hit_count = do_search(hits); 
+    hit_count = do_search(hits);
     if(hit_count != 10) throw AppException(EX_APP_SEARCHER, "");
     for(unsigned int i=0; i<hits.size(); i++) {
       if(i>0 && hits[i].sortkey[0] < hits[i-1].sortkey[0]) throw AppException(EX_APP_SEARCHER, "");
@@ -634,7 +1213,7 @@ bool Searcher::test() {
     delete val;
     lazy_count = false;
     hits.clear();
-    hit_count = do_search(hits); 
+    hit_count = do_search(hits);
     if(hit_count != 10) throw AppException(EX_APP_SEARCHER, "");
     for(unsigned int i=0; i<hits.size(); i++) {
       if(hits[i].id < 350 || hits[i].id > 360) throw AppException(EX_APP_SEARCHER, "");
@@ -649,10 +1228,32 @@ bool Searcher::test() {
     delete val;
     lazy_count = false;
     hits.clear();
-    hit_count = do_search(hits); 
+    hit_count = do_search(hits);
     for(unsigned int i=0; i<hits.size(); i++) {
       if(hits[i].id % 10 != 0 || (hits[i].id % 7 != 0 && hits[i].id % 7 != 1 && hits[i].id % 7 != 2)) throw AppException(EX_APP_SEARCHER, "");
     }
+
+    std::cout << "count only request...\n";
+    request_str = "{\"count_only\":true, \"conditions\":[[\"title\", \"equal\", \"p000000\"], [[\"title\", \"equal\", \"p000010\"], [\"title\", \"equal\", \"p000011\"], [\"title\", \"equal\", \"p000012\"]]]}";
+    val = JsonImport::json_import(request_str); 
+    init();
+    if(!parse_request(val, cfg)) throw AppException(EX_APP_SEARCHER, "");
+    delete val;
+    val = NULL;
+    hits.clear();
+    if(do_search(hits) != hit_count || hits.size() != 0 || !count_exact) throw AppException(EX_APP_SEARCHER, "");
+
+    std::cout << "exact count request...\n";
+    request_str = "{\"exact_count\":true, \"conditions\":[\"title\", \"prefix\", \"p\"]}";
+    val = JsonImport::json_import(request_str); 
+    init();
+    cfg.max_count = 100;
+    if(!parse_request(val, cfg)) throw AppException(EX_APP_SEARCHER, "");
+    delete val;
+    val = NULL;
+    hits.clear();
+    if(do_search(hits) != 100 || hits.size() != 10 || count_exact) throw AppException(EX_APP_SEARCHER, "");
+    cfg.max_count = 1000000;
     
     std::cout << "ordered request...\n";
     request_str = "{\"offset\":0, \"limit\":10, \"conditions\":[\"title\", \"equal\", \"p000099\"], \"order\":[\"rank\"]}";
@@ -660,6 +1261,134 @@ bool Searcher::test() {
     init();
     if(!parse_request(val, cfg)) throw AppException(EX_APP_SEARCHER, "");
     delete val;
+    val = NULL;
+    lazy_count = false;
+    hits.clear();
+    hit_count = do_search(hits);
+    if(hit_count != 3000 || hits.size() != 10) throw AppException(EX_APP_SEARCHER, "");
+    for(unsigned int i=1; i<hits.size(); i++) {
+      if(search_hit_data_comp(hits[i-1], hits[i]) > 0) throw AppException(EX_APP_SEARCHER, "");
+    }
+
+    std::cout << "cursor request...\n";
+    SEARCH_HIT_DATA_SET all_hits;
+    request_str = "{\"offset\":0, \"limit\":30, \"conditions\":[[[\"title\", \"equal\", \"p000001\"], [\"title\", \"equal\", \"p000002\"]]], \"order\":[\"rank\"]}";
+    val = JsonImport::json_import(request_str); 
+    init();
+    if(!parse_request(val, cfg)) throw AppException(EX_APP_SEARCHER, "");
+    delete val;
+    val = NULL;
+    lazy_count = false;
+    hit_count = do_search(all_hits);
+    std::string next_cursor = "";
+    for(int page=0; page<3; page++) {
+      request_str = "{\"limit\":10, \"conditions\":[[[\"title\", \"equal\", \"p000001\"], [\"title\", \"equal\", \"p000002\"]]], \"order\":[\"rank\"], \"cursor\":\"" + next_cursor + "\"}";
+      val = JsonImport::json_import(request_str); 
+      init();
+      if(!parse_request(val, cfg)) throw AppException(EX_APP_SEARCHER, "");
+      delete val;
+      val = NULL;
+      lazy_count = false;
+      hits.clear();
+      if(do_search(hits) != hit_count - page*10 || hits.size() != 10) throw AppException(EX_APP_SEARCHER, "");
+      for(unsigned int i=0; i<hits.size(); i++) {
+        if(hits[i].id != all_hits[page*10+i].id) throw AppException(EX_APP_SEARCHER, "");
+      }
+      next_cursor = make_cursor(hits[hits.size()-1]);
+    }
+
+    request_str = "{\"count_only\":true, \"conditions\":[\"title\", \"equal\", \"p000001\"], \"cursor\":\"" + next_cursor + "\"}";
+    val = JsonImport::json_import(request_str); 
+    init();
+    if(parse_request(val, cfg)) throw AppException(EX_APP_SEARCHER, "");
+    delete val;
+    val = NULL;
+
+    std::cout << "sector parallel request...\n";
+    data.init();
+    data.set_sample(t.header, 3);
+    const char* parallel_requests[] = {
+      "{\"offset\":5, \"limit\":20, \"conditions\":[\"title\", \"equal\", \"p000099\"]}",
+      "{\"offset\":0, \"limit\":3000, \"conditions\":[[\"title\", \"equal\", \"p000000\"], [[\"title\", \"equal\", \"p000010\"], [\"title\", \"equal\", \"p000011\"]]]}",
+      "{\"offset\":0, \"limit\":30, \"conditions\":[\"title\", \"prefix\", \"p0000\"], \"order\":[\"rank\"]}",
+      "{\"offset\":0, \"limit\":10, \"conditions\":[\"title\", \"equal\", \"p000003\"], \"facets\":[\"title\"]}"
+    };
+    for(unsigned int i=0; i<sizeof(parallel_requests)/sizeof(parallel_requests[0]); i++) {
+      SEARCH_HIT_DATA_SET serial_hits;
+      FACET_COUNT_MAP     serial_facets;
+      for(int threads=1; threads<=4; threads+=3) {
+        val = JsonImport::json_import(parallel_requests[i]);
+        init();
+        cfg.search_threads = threads;
+        if(!parse_request(val, cfg)) throw AppException(EX_APP_SEARCHER, "");
+        delete val;
+        val = NULL;
+        lazy_count = false;
+        hits.clear();
+        int count = do_search(hits);
+        if(threads == 1) {
+          hit_count = count;
+          serial_hits = hits;
+          serial_facets = facet_counts;
+          continue;
+        }
+        if(count != hit_count || hits.size() != serial_hits.size() || hits.size() == 0) throw AppException(EX_APP_SEARCHER, "");
+        if(facet_counts != serial_facets) throw AppException(EX_APP_SEARCHER, "");
+        for(unsigned int j=0; j<hits.size(); j++) {
+          if(hits[j].id != serial_hits[j].id) throw AppException(EX_APP_SEARCHER, "");
+        }
+      }
+    }
+    cfg.search_threads = 1;
+
+    // "apple kiwi東京" is apple, (break), kiwi, 東京. 東京 must follow kiwi even when
+    // the rarer apple would lead the AND below the phrase node.
+    std::cout << "fulltext request with a break...\n";
+    data.init();
+    Buffer index_buf;
+    Indexer indexer(path, log_file, attrs, shm, morph, &index_buf);
+    const char* documents[] = {
+      "{\"id\":1, \"content\":\"apple kiwi東京\", \"user\":\"c1\"}",
+      "{\"id\":2, \"content\":\"apple東京 kiwi\"}",
+      "{\"id\":3, \"content\":\"kiwi\"}",
+      "{\"id\":4, \"content\":\"kiwi\"}",
+      "{\"id\":5, \"content\":\"kiwi\"}",
+      "{\"id\":6, \"content\":\"kiwi東京\", \"user\":\"c2\"}",
+      "{\"id\":7, \"content\":\"kiwi東京\", \"user\":\"c2\"}"
+    };
+    INSERT_REGULAR_INDEX_SET documents_set;
+    for(unsigned int i=0; i<sizeof(documents)/sizeof(documents[0]); i++) {
+      InsertRegularIndex idx;
+      val = JsonImport::json_import(documents[i]);
+      if(!indexer.parse_request(idx, val)) throw AppException(EX_APP_SEARCHER, "");
+      delete val;
+      val = NULL;
+      documents_set.push_back(idx);
+    }
+    if(!indexer.do_index(documents_set)) throw AppException(EX_APP_SEARCHER, "");
+    indexer.data.finish();
+
+    request_str = "{\"offset\":0, \"limit\":10, \"conditions\":[\"content\", \"equal\", \"apple kiwi東京\"]}";
+    val = JsonImport::json_import(request_str); 
+    init();
+    if(!parse_request(val, cfg)) throw AppException(EX_APP_SEARCHER, "");
+    delete val;
+    val = NULL;
+    hits.clear();
+    if(do_search(hits) != 1 || hits.size() != 1 || hits[0].id != 1) throw AppException(EX_APP_SEARCHER, "");
+
+    // the phrase condition is counted by the iterators, their hits have no document id
+    std::cout << "count_only facets request with a phrase condition...\n";
+    request_str = "{\"count_only\":true, \"conditions\":[\"content\", \"equal\", \"kiwi東京\"], \"facets\":[\"user\"]}";
+    val = JsonImport::json_import(request_str); 
+    init();
+    if(!parse_request(val, cfg)) throw AppException(EX_APP_SEARCHER, "");
+    delete val;
+    val = NULL;
+    hits.clear();
+    if(is_set_node(root_node) || do_search(hits) != 3) throw AppException(EX_APP_SEARCHER, "");
+    if(facet_counts["user"].size() != 2 || facet_counts["user"]["c1"] != 1 ||
+       facet_counts["user"]["c2"] != 2) throw AppException(EX_APP_SEARCHER, "");
   } catch(AppException e) {
     if(val) delete val;
     return false;
@@ -682,6 +1411,7 @@ void Searcher::dump() {
     else if(nodes[i].type == SEARCH_NODE_TYPE_AND)  std::cout << "[AND]";
     else if(nodes[i].type == SEARCH_NODE_TYPE_OR)   std::cout << "[OR]";
     else if(nodes[i].type == SEARCH_NODE_TYPE_LEAF) std::cout << "[LEAF]";
+    else if(nodes[i].type == SEARCH_NODE_TYPE_ANDNOT) std::cout << "[ANDNOT]";
     else                                              std::cout << "[UNKNOWN]";
 
     if(nodes[i].cache != -1) {
@@ -21,32 +21,44 @@
 #include <sys/file.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "common.h"
 #include "data_controller.h"
 #include "app_config.h"
 #include "shared_memory_access.h"
 #include "buffer.h"
+#include "morph_controller.h"
 #include "indexer.h"
+#include "search_iterator.h"
+#include "set_kernel.h"
 
 
 class Searcher {
 public:
   int offset;
   int limit;
+  bool count_only;   // no result, hits are keyed by document address
+  bool exact_count;  // count to the end (up to max_count) instead of estimating
+  bool count_exact;  // set by do_search
+  FACET_COUNT_MAP facet_counts;  // documents per value of the facet attributes, set by do_search
 
   Searcher();
-  Searcher(std::string, std::string, ATTR_TYPE_MAP*, SharedMemoryAccess*);
+  Searcher(std::string, std::string, ATTR_TYPE_MAP*, SharedMemoryAccess*, MorphController*);
   ~Searcher();
 
   void init();
-  void setup(std::string, std::string, ATTR_TYPE_MAP*, SharedMemoryAccess*);
+  void finish();
+  void setup(std::string, std::string, ATTR_TYPE_MAP*, SharedMemoryAccess*, MorphController*);
 
   bool parse_request(JsonValue*, AppConfig&);
   int  do_search(SEARCH_HIT_DATA_SET&);
   bool search(JsonValue*, JsonValue*, AppConfig&);
   bool match(JsonValue*, JsonValue*, AppConfig&);
 
+  std::string make_cursor(SearchHitData&);
+
   bool test();
   void dump();
 
@@ -56,8 +68,26 @@ private:
 
   ATTR_TYPE_MAP* attrs;
   SharedMemoryAccess* shm;
+  MorphController*    morph;
 
   bool lazy_count;
+  int  max_count;
+  SearchHitData cursor;  // empty if the request has no cursor
+
+  // facets are tallied over the counted documents by their phrases in the regular index
+  WORD_SET         facet_names;
+  ATTR_TYPE_SET    facet_types;
+  PHRASE_COUNT_MAP facet_phrases;  // phrase addr -> facet, -1 for the other phrases
+  PHRASE_COUNT_MAP facet_hits;     // phrase addr -> documents
+
+  // sector parallel search, workers search the sectors [sector_from, sector_to]
+  int            search_threads;
+  unsigned short sector_from;
+  unsigned short sector_to;
+  std::vector<Searcher*> workers;
+  SEARCH_HIT_DATA_SET    worker_result;
+  int                    worker_count;
+  bool                   worker_error;
 
   DataController   data;
   Buffer           buf;
@@ -65,21 +95,37 @@ private:
   int root_node;
   SEARCH_CACHE_SET caches;
   ATTR_TYPE_SET    order;
+  std::vector<SearchIterator*> iterators;  // built from nodes by do_search
+  SearchIterator*              root_iterator;
 
   int         parse_conditions(JsonValue*);
   int         parse_conditions_level1(JsonValue*);
   int         parse_conditions_level2(JsonValue*);
   int         parse_conditions_leaf(JsonValue*);
   int         parse_conditions_fulltext(JsonValue*, std::string, AttrDataType);
+  int         parse_conditions_exclusion(JsonValue*, std::string, AttrDataType);
   char*       parse_conditions_index(std::string, AttrDataType, JsonValue* val);
   bool        parse_order(JsonValue*);
+  bool        parse_cursor(JsonValue*);
+  bool        parse_facets(JsonValue*);
 
 
-  SearchHitData pickup_hit(int);
-  void          clear_current_hit(int);
-  SearchHitData pickup_cache(int);
+  int           do_search_parallel(SEARCH_HIT_DATA_SET&, unsigned short);
+  static void*  search_worker(void*);
+  SearchHitData next_hit(bool&, int&);
+  int           search_progress(int&);
   void          setup_cache();
-  void          setup_node();
+  void          load_hits(SearchPartial&);
+  int           estimate_node(int);
+  int           plan_node(int);
+  bool          is_set_node(int);
+  void          count_set(int, SECTOR_OFFSET_MAP&);
+  SearchIterator* build_iterator(int);
+  void            clear_iterators();
+  DocumentAddr  hit_document_addr(const SearchHitData&);
+  void          count_facets(DocumentAddr);
+  int           facet_value(PhraseAddr, std::string&);
+  void          set_facet_counts();
 };
 
   
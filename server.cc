@@ -18,6 +18,75 @@ std::string(*Server::app_func)(const char*, pthread_mutex_t*, int) = NULL;
 bool(*Server::wait_func)(void) = NULL;
 AllowedHostContainer Server::allowed_hosts;
 pthread_mutex_t*   Server::mutex = NULL;
+ServerQueue*       Server::queue = NULL;
+int                Server::notify_pipe[2] = {-1, -1};
+volatile sig_atomic_t Server::stop_flag = 0;
+
+
+
+// worker queue
+ServerQueue::ServerQueue() {
+  ring = NULL;
+  capacity = head = count = 0;
+  stopped = false;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&not_empty, NULL);
+}
+
+
+ServerQueue::~ServerQueue() {
+  if(ring) delete[] ring;
+  pthread_cond_destroy(&not_empty);
+  pthread_mutex_destroy(&lock);
+}
+
+
+void ServerQueue::init(unsigned int size) {
+  pthread_mutex_lock(&lock);
+  if(ring) delete[] ring;
+  capacity = size > 0 ? size : 1;
+  ring = new ServerConnection*[capacity];
+  head = count = 0;
+  stopped = false;
+  pthread_mutex_unlock(&lock);
+}
+
+
+bool ServerQueue::push(ServerConnection* conn) {
+  pthread_mutex_lock(&lock);
+  if(count >= capacity) {
+    pthread_mutex_unlock(&lock);
+    return false;
+  }
+  ring[(head + count) % capacity] = conn;
+  count++;
+  pthread_cond_signal(&not_empty);
+  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+
+ServerConnection* ServerQueue::pop(void) {
+  pthread_mutex_lock(&lock);
+  while(count == 0 && !stopped) pthread_cond_wait(&not_empty, &lock);
+
+  ServerConnection* conn = NULL;
+  if(count > 0) {
+    conn = ring[head];
+    head = (head + 1) % capacity;
+    count--;
+  }
+  pthread_mutex_unlock(&lock);
+  return conn;
+}
+
+
+void ServerQueue::stop(void) {
+  pthread_mutex_lock(&lock);
+  stopped = true;
+  pthread_cond_broadcast(&not_empty);
+  pthread_mutex_unlock(&lock);
+}
 
 
 
@@ -25,6 +94,7 @@ pthread_mutex_t*   Server::mutex = NULL;
 Server::Server( std::string(*fapp)(const char*, pthread_mutex_t*, int), bool(*fwait)(void) )
 {
   end_flag = false;
+  epoll_fd = -1;
   app_func = fapp;
   wait_func = fwait;
 
@@ -51,97 +121,79 @@ void Server :: socket_set(struct sockaddr_in& src_addr, unsigned short port) {
 }
 
 
-std::string Server :: socket_read(int read_socket) {
-  // const char end[] = {0x0a};  //end code
-  int idle_time = 0;
-
-  fd_set fdset;
-  struct timeval tv;
-  tv.tv_sec = 0;
-  tv.tv_usec = 0;
-  
-  bool  multiline_mode = false; 
-  char  buffer[BUFFER_SIZE+1];
-  char  req[MAX_REQUEST_SIZE];
-  int   req_pos = 0;
-
-  std::string response = "";
-
-  int buf_pos= 0;
-  int numrcv = -1;
-  while(1) {
-    FD_ZERO(&fdset);
-    FD_SET(read_socket, &fdset);
-
-    bool completed = false;
-    if(numrcv==-1 && select(read_socket+1, &fdset, NULL, NULL, &tv) == 1) { // buffer complete && exists recv data
-      errno = 0;
-      numrcv = recv(read_socket, buffer, BUFFER_SIZE, 0);
-      if(numrcv == 0 || errno == EINTR) throw AppException(EX_APP_SERVER, "Connection closed");
-      buf_pos = 0;
-      idle_time = 0;
-    }
+bool Server :: socket_read(ServerConnection* conn) {
+  char  buffer[BUFFER_SIZE];
+  bool  alive = true;
+  std::list<std::string> lines;
 
+  // edge triggered: read until EAGAIN
+  while(alive) {
+    int numrcv = recv(conn->conn_sock, buffer, BUFFER_SIZE, 0);
     if(numrcv == -1) {
-      usleep(CONNECT_DURATION);
-      idle_time += CONNECT_DURATION;
-      if(idle_time > TIMEOUT*100000) throw AppException(EX_APP_SERVER, "Connection timeout");
+      if(errno == EINTR) continue;
+      if(errno != EAGAIN && errno != EWOULDBLOCK) alive = false;
+      break;
+    }
+    if(numrcv == 0) {
+      alive = false;
+      break;
     }
 
-    while(numrcv != -1) {
-      if(buf_pos >= numrcv) {
-        numrcv = -1;
-        break;
-      }
-
+    int head = 0;
+    for(int buf_pos=0; buf_pos<numrcv; buf_pos++) {
       if(buffer[buf_pos]=='\r' || buffer[buf_pos]=='\n' || buffer[buf_pos] == '\0') {
-        req[req_pos++] = '\0';
-        buf_pos++;
-        completed = true;
-        break;
+        conn->recv_buf.append(buffer + head, buf_pos - head);
+        if(!conn->recv_buf.empty()) lines.push_back(conn->recv_buf);
+        conn->recv_buf.clear();
+        head = buf_pos + 1;
       }
-
-      req[req_pos++] = buffer[buf_pos++];
-      if(req_pos > MAX_REQUEST_SIZE)  throw AppException(EX_APP_SERVER, "Too large request");
     }
+    conn->recv_buf.append(buffer + head, numrcv - head);
 
-    if(completed) {
-      req_pos = 0;
-      if(multiline_mode) {
-        if(strcmp(req, "END") == 0) { // multiline end
-          response = (*app_func)("{\"command\":\"index\"}", mutex, INDEX_FLAG_FIN);
-          break;
-        } else {  // multiline continue
-          (*app_func)(req, mutex, INDEX_FLAG_CONT);
-        }
-      } else {
-        if(strcmp(req, "BEGIN") == 0) {  // multiline start
-          multiline_mode = true;
-        } else { 
-          response = (*app_func)(req, mutex, INDEX_FLAG_FIN); // singleline
-          break;
-        }
-      }
+    if(conn->recv_buf.size() > (unsigned int)MAX_REQUEST_SIZE) {
+      std::cout << "Too large request\n";
+      conn->recv_buf.clear();
+      alive = false;
     }
   }
-    
-  return response;
+
+  pthread_mutex_lock(&conn->lock);
+  conn->requests.splice(conn->requests.end(), lines);
+  if(!alive) conn->closed = true;
+  conn->last_access = time(NULL);
+  pthread_mutex_unlock(&conn->lock);
+
+  return alive;
 }
 
 
 void Server :: socket_write(int write_socket, std::string response) {
-  send(write_socket, response.c_str(), response.length(), 0);
+  const char* p = response.c_str();
+  size_t left = response.length();
+
+  while(left > 0) {
+    ssize_t numsnd = send(write_socket, p, left, MSG_NOSIGNAL);
+    if(numsnd == -1) {
+      if(errno == EINTR) continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK) {
+        struct pollfd pfd;
+        pfd.fd = write_socket, pfd.events = POLLOUT, pfd.revents = 0;
+        if(poll(&pfd, 1, TIMEOUT*1000) <= 0) throw AppException(EX_APP_SERVER, "Connection timeout");
+        continue;
+      }
+      throw AppException(EX_APP_SERVER, "Connection closed");
+    }
+    p    += numsnd;
+    left -= numsnd;
+  }
 }
 
 
 
-void Server::start(unsigned short port) 
+void Server::start(unsigned short port, unsigned int workers, unsigned int queue_size) 
 {
   int src_socket;    
-  int dst_socket;  
   struct sockaddr_in src_addr; 
-  struct sockaddr_in dst_addr;  
-  socklen_t dst_addr_length = sizeof(dst_addr); 
 
   socket_set(src_addr, port);
 
@@ -165,58 +217,223 @@ void Server::start(unsigned short port)
   }
 
   if (listen( src_socket, SOMAXCONN ) == -1) {throw AppException(EX_APP_SERVER, "Failed to listen");}
-  // fcntl( src_socket, F_SETFL, O_NONBLOCK );
+  fcntl( src_socket, F_SETFL, O_NONBLOCK );
 
   // initialize mutex 
   mutex = new pthread_mutex_t[MUTEX_COUNT]; 
   for(unsigned int i=0; i<MUTEX_COUNT; i++) pthread_mutex_init(&mutex[i], NULL);
 
-  // initialize connection slot
-  ServerThreadArg* args = new ServerThreadArg[MAX_CONNECTION];
-  for(int i=0; i<MAX_CONNECTION; i++) {
-    args[i].available = true, args[i].joinable = false;
+  // event loop: listen socket is level triggered, connections are edge triggered
+  if(pipe(notify_pipe) == -1) throw AppException(EX_APP_SERVER, "Failed to create pipe");
+  fcntl( notify_pipe[0], F_SETFL, O_NONBLOCK );
+
+  epoll_fd = epoll_create(MAX_EVENTS);
+  if(epoll_fd == -1) throw AppException(EX_APP_SERVER, "Failed to create epoll");
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN, ev.data.fd = src_socket;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, src_socket, &ev);
+  ev.events = EPOLLIN, ev.data.fd = notify_pipe[0];
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, notify_pipe[0], &ev);
+
+  // initialize worker threads
+  if(workers == 0) workers = 1;
+  queue = new ServerQueue();
+  queue->init(queue_size);
+  pthread_t* threads = new pthread_t[workers];
+  for(unsigned int i=0; i<workers; i++) pthread_create(&threads[i], NULL, thread_main, NULL);
+
+  struct epoll_event events[MAX_EVENTS];
+  time_t last_check = time(NULL);
+  while (!end_flag && !stop_flag) {
+    int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, EVENT_WAIT);
+    if(nfds == -1) {
+      if(errno == EINTR) continue;
+      throw AppException(EX_APP_SERVER, "Failed to wait event");
+    }
+
+    for(int i=0; i<nfds; i++) {
+      int fd = events[i].data.fd;
+      if(fd == src_socket) {
+        accept_connections(src_socket);
+      } else if(fd == notify_pipe[0]) {
+        close_notified();
+      } else {
+        SERVER_CONNECTION_MAP::iterator it = connections.find(fd);
+        if(it == connections.end()) continue;
+        socket_read(it->second);
+        dispatch(it->second);
+      }
+    }
+
+    if(!deferred.empty()) dispatch_deferred();
+
+    if(time(NULL) != last_check) {
+      close_timeout();
+      last_check = time(NULL);
+    }
+  }
+
+  // stop worker threads
+  queue->stop();
+  for(unsigned int i=0; i<workers; i++) pthread_join(threads[i], NULL);
+
+  while(!connections.empty()) {
+    ServerConnection* conn = connections.begin()->second;
+    conn->running = false;
+    close_connection(conn);
+  }
+
+  delete[] mutex;
+  delete[] threads;
+  delete queue;
+  queue = NULL;
+
+  close(epoll_fd);
+  close(notify_pipe[0]);
+  int notify_fd = notify_pipe[1];
+  notify_pipe[0] = notify_pipe[1] = -1;
+  close(notify_fd);
+  close(src_socket);
+}
+
+
+// called from signal handlers, the event loop is woken up by -1 in the pipe
+void Server::stop(void)
+{
+  int saved_errno = errno;
+  int fd = -1;
+  stop_flag = 1;
+  if(notify_pipe[1] != -1 && write(notify_pipe[1], &fd, sizeof(fd)) == -1) {
+    // the loop notices stop_flag at the next wait
   }
+  errno = saved_errno;
+}
+
 
-  while (!end_flag) {
-    dst_socket = accept( src_socket,(struct sockaddr *)&dst_addr, &dst_addr_length);
+void Server::accept_connections(int src_socket)
+{
+  struct sockaddr_in dst_addr;  
+  socklen_t dst_addr_length;
 
+  while(1) {
+    dst_addr_length = sizeof(dst_addr); 
+    int dst_socket = accept( src_socket,(struct sockaddr *)&dst_addr, &dst_addr_length);
     if(dst_socket == -1) {
-      usleep(CONNECT_DURATION);
+      if(errno == EINTR) continue;
+      break;
+    }
+
+    if(!is_allowed_host(dst_addr)) {
+      std::cout << "connection denied\n";
+      close(dst_socket);
       continue;
     }
+    fcntl( dst_socket, F_SETFL, O_NONBLOCK );
+
+    ServerConnection* conn = new ServerConnection;
+    conn->conn_sock = dst_socket;
+    conn->conn_addr = dst_addr;
+    conn->multiline = false;
+    conn->keepalive = false;
+    conn->running   = false;
+    conn->closed    = false;
+    conn->finished  = false;
+    conn->last_access = time(NULL);
+    pthread_mutex_init(&conn->lock, NULL);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET, ev.data.fd = dst_socket;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dst_socket, &ev) == -1) {
+      pthread_mutex_destroy(&conn->lock);
+      delete conn;
+      close(dst_socket);
+      continue;
+    }
+    connections[dst_socket] = conn;
+  }
+}
 
-    bool complete = false;
-    while(!complete) {
-      for(int i=0; i<MAX_CONNECTION; i++) {
-        if(args[i].joinable) {
-          pthread_join(args[i].th, NULL);
-          args[i].joinable  = false;
-          args[i].available = true;
-        }
-      }
 
-      if(dst_socket == -1) {
-        usleep(CONNECT_DURATION);
-        break;
-      }
-
-      for(int i=0; i<MAX_CONNECTION; i++) {
-        if(args[i].available) {
-          args[i].conn_sock = dst_socket;
-          args[i].conn_addr = dst_addr;
-          args[i].joinable = false;
-          args[i].available = false;
-          pthread_create(&args[i].th, NULL, thread_main, (void*)(&args[i]));
-          complete = true;
-          break;
-        }
+// hand the connection to a worker, or close it when nothing is left to do
+void Server::dispatch(ServerConnection* conn)
+{
+  bool close_flag = false;
+
+  pthread_mutex_lock(&conn->lock);
+  if(!conn->running) {
+    if(!conn->finished && !conn->requests.empty()) {
+      if(queue->push(conn)) {
+        conn->running = true;
+      } else if(conn->multiline) {
+        // do not break a batch in the middle, retry later
+        deferred.insert(conn->conn_sock);
+      } else {
+        std::string response = "{\"error\":true,\"message\":\"Server busy\"}\n";
+        send(conn->conn_sock, response.c_str(), response.length(), MSG_NOSIGNAL);
+        conn->finished = true;
+        close_flag = true;
       }
+    } else if(conn->finished || conn->closed) {
+      close_flag = true;
     }
   }
-  delete[] mutex;
-  delete[] args;
+  pthread_mutex_unlock(&conn->lock);
 
-  close(src_socket);
+  if(close_flag) close_connection(conn);
+}
+
+
+void Server::dispatch_deferred(void)
+{
+  std::set<int> fds;
+  fds.swap(deferred);
+
+  for(std::set<int>::iterator it = fds.begin(); it != fds.end(); it++) {
+    SERVER_CONNECTION_MAP::iterator c = connections.find(*it);
+    if(c != connections.end()) dispatch(c->second);
+  }
+}
+
+
+void Server::close_connection(ServerConnection* conn)
+{
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->conn_sock, NULL);
+  close(conn->conn_sock);
+  connections.erase(conn->conn_sock);
+  deferred.erase(conn->conn_sock);
+  pthread_mutex_destroy(&conn->lock);
+  delete conn;
+}
+
+
+// connections returned from worker threads
+void Server::close_notified(void)
+{
+  int fd;
+  while(read(notify_pipe[0], &fd, sizeof(fd)) == sizeof(fd)) {
+    if(fd == -1) continue;  // stop()
+    SERVER_CONNECTION_MAP::iterator it = connections.find(fd);
+    if(it != connections.end()) dispatch(it->second);
+  }
+}
+
+
+void Server::close_timeout(void)
+{
+  time_t now = time(NULL);
+  std::vector<ServerConnection*> expired;
+
+  for(SERVER_CONNECTION_MAP::iterator it = connections.begin(); it != connections.end(); it++) {
+    ServerConnection* conn = it->second;
+    pthread_mutex_lock(&conn->lock);
+    if(!conn->running && now - conn->last_access > TIMEOUT) expired.push_back(conn);
+    pthread_mutex_unlock(&conn->lock);
+  }
+
+  for(unsigned int i=0; i<expired.size(); i++) close_connection(expired[i]);
 }
 
 
@@ -242,20 +459,86 @@ bool Server::is_allowed_host(const sockaddr_in &addr)
 }
 
 
-void* Server::thread_main(void* p) {
-  ServerThreadArg* arg = (ServerThreadArg*)p;
-  std::string response = "";
+// worker thread
+void* Server::thread_main(void*) {
+  while(1) {
+    ServerConnection* conn = queue->pop();
+    if(conn == NULL) break;
+    process_connection(conn);
+  }
+  return NULL;
+}
+
+
+void Server::process_connection(ServerConnection* conn) {
+  int sock = conn->conn_sock;
+  std::string req;
+  std::string output = "";  // pipelined responses not written yet
 
-  try {
-    if(!is_allowed_host(arg->conn_addr)) throw AppException(EX_APP_SERVER, "connection denied");
-    response = socket_read(arg->conn_sock);
-    socket_write(arg->conn_sock, response);
-  } catch(AppException e) {
-    std::cout << e.what() << "\n";
-    response = e.what();
+  while(1) {
+    try {
+      pthread_mutex_lock(&conn->lock);
+      if(conn->finished || conn->requests.empty()) {
+        if(!output.empty()) {
+          pthread_mutex_unlock(&conn->lock);
+          socket_write(sock, output);
+          output.clear();
+          continue;
+        }
+        conn->running = false;
+        pthread_mutex_unlock(&conn->lock);
+        break;
+      }
+      req = conn->requests.front();
+      conn->requests.pop_front();
+      pthread_mutex_unlock(&conn->lock);
+
+      bool completed = false;
+      std::string response = "";
+
+      if(conn->multiline) {
+        if(req == "END") { // multiline end
+          response = (*app_func)("{\"command\":\"index\"}", mutex, INDEX_FLAG_FIN);
+          conn->multiline = false;
+          completed = true;
+        } else {  // multiline continue
+          (*app_func)(req.c_str(), mutex, INDEX_FLAG_CONT);
+        }
+      } else {
+        if(req == "BEGIN") {  // multiline start
+          conn->multiline = true;
+        } else if(req == "KEEPALIVE") {  // persistent connection
+          conn->keepalive = true;
+        } else if(req == "QUIT") {
+          pthread_mutex_lock(&conn->lock);
+          conn->finished = true;
+          pthread_mutex_unlock(&conn->lock);
+        } else { 
+          response = (*app_func)(req.c_str(), mutex, INDEX_FLAG_FIN); // singleline
+          completed = true;
+        }
+      }
+
+      if(completed) {
+        output += response;
+        if(!conn->keepalive) {
+          pthread_mutex_lock(&conn->lock);
+          conn->finished = true;
+          pthread_mutex_unlock(&conn->lock);
+        } else if(output.size() > (unsigned int)BUFFER_SIZE) {
+          socket_write(sock, output);
+          output.clear();
+        }
+      }
+    } catch(AppException e) {
+      std::cout << e.what() << "\n";
+      output.clear();
+      pthread_mutex_lock(&conn->lock);
+      conn->closed = conn->finished = true;
+      pthread_mutex_unlock(&conn->lock);
+    }
   }
 
-  close(arg->conn_sock);
-  arg->joinable = true;
-  pthread_exit(0);
+  // conn may be released by the event loop from here
+  if(write(notify_pipe[1], &sock, sizeof(sock)) == -1) std::cout << "Failed to notify\n";
 }
@@ -14,12 +14,17 @@
 
 #include <string>
 #include <vector>
+#include <list>
+#include <map>
+#include <set>
 #include <iostream>
 
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -36,7 +41,6 @@
 #define MUTEX_CONN_COUNTER    0
 #define MUTEX_SEARCHER        1
 #define MUTEX_INDEXER         2
-#define MUTEX_PARSER          3
 #define MUTEX_INDEXER_PROC1   4
 #define MUTEX_INDEXER_PROC2   5
 #define MUTEX_INDEXER_PROC3   6
@@ -47,14 +51,44 @@ typedef std::pair<unsigned long, char> AllowedHost;
 typedef std::vector<AllowedHost> AllowedHostContainer;
 
 
-struct ServerThreadArg {
-  pthread_t           th;
+struct ServerConnection {
   int                 conn_sock;
   struct sockaddr_in  conn_addr;
-  bool                available;
-  bool                joinable;
+  std::string         recv_buf;     // incomplete request line
+  std::list<std::string> requests;  // complete request lines, not yet processed
+  bool                multiline;    // inside BEGIN ... END
+  bool                keepalive;    // KEEPALIVE: keep open after responses
+  bool                running;      // owned by a worker thread
+  bool                closed;       // peer closed or read error
+  bool                finished;     // no more requests are processed
+  time_t              last_access;
+
+  pthread_mutex_t     lock;         // guards requests and flags
+};
+
+typedef std::map<int, ServerConnection*> SERVER_CONNECTION_MAP;
+
+
+// bounded ring buffer shared by the event loop and worker threads
+class ServerQueue {
+public:
+  ServerQueue();
+  ~ServerQueue();
+
+  void init(unsigned int);
+  bool push(ServerConnection*);   // false when full
+  ServerConnection* pop(void);    // blocks, NULL after stop()
+  void stop(void);
 
-  pthread_mutex_t*    mutex;
+private:
+  ServerConnection** ring;
+  unsigned int capacity;
+  unsigned int head;
+  unsigned int count;
+  bool         stopped;
+
+  pthread_mutex_t lock;
+  pthread_cond_t  not_empty;
 };
 
 
@@ -63,32 +97,47 @@ public:
     Server( std::string(*)(const char*, pthread_mutex_t*, int), bool(*)(void) );
     virtual ~Server();
 
-    void start(unsigned short port);
+    void start(unsigned short port, unsigned int workers, unsigned int queue_size);
     static void* thread_main(void*);
+    static void stop(void);  // async-signal-safe, start() returns
 
 private:
-    const static int MAX_CONNECTION = 100;
+    const static int MAX_EVENTS = 256;
     const static int MAX_REQUEST_SIZE = 1000000;  // 1MB
     const static int BUFFER_SIZE = 4096;
-    const static int TIMEOUT     = 30;
-    const static int CONNECT_DURATION = 200;
+    const static int TIMEOUT     = 30;    // sec
+    const static int EVENT_WAIT  = 1000;  // msec
 
     static AllowedHostContainer allowed_hosts;
     static pthread_mutex_t*   mutex;
 
     static std::string(*app_func)(const char*, pthread_mutex_t*, int);  // main application
     static bool(*wait_func)(void);  // connection wait application
-    static std::string socket_read(int);
     static void socket_write(int, std::string);
     static bool is_allowed_host(const sockaddr_in&);
-   
+    static void process_connection(ServerConnection*);
+
+    // worker queue
+    static ServerQueue* queue;
+    static int         notify_pipe[2];  // worker -> event loop
+    static volatile sig_atomic_t stop_flag;
 
     // not static 
     bool end_flag;
+    int  epoll_fd;
+    SERVER_CONNECTION_MAP connections;
+    std::set<int>         deferred;  // batches waiting for a free queue slot
 
     Server();
 
     void socket_set(sockaddr_in&, unsigned short int);
+    bool socket_read(ServerConnection*);
+    void accept_connections(int);
+    void dispatch(ServerConnection*);
+    void dispatch_deferred(void);
+    void close_connection(ServerConnection*);
+    void close_notified(void);
+    void close_timeout(void);
     inline void end(void) {end_flag = true;}
 };
 
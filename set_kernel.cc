@@ -0,0 +1,287 @@
+/*****************************************************************
+ *  set_kernel.cc
+ *    sorted set operations on posting blocks
+ *
+ *****************************************************************/
+
+#include "set_kernel.h"
+
+static unsigned int subtract_scalar(const unsigned int* a, unsigned int na, const unsigned int* b, unsigned int nb, unsigned int* out) {
+  unsigned int i = 0, j = 0, n = 0;
+  while(i < na && j < nb) {
+    if(a[i] < b[j])      out[n++] = a[i++];
+    else if(a[i] > b[j]) j++;
+    else                 i++, j++;
+  }
+  while(i < na) out[n++] = a[i++];
+  return n;
+}
+
+
+#ifdef SET_KERNEL_SIMD
+#include <immintrin.h>
+#endif
+
+int             SetKernel::kernel = SET_KERNEL_SCALAR;
+SET_KERNEL_FUNC SetKernel::intersect_func = NULL;
+SET_KERNEL_FUNC SetKernel::unite_func = NULL;
+SET_KERNEL_FUNC SetKernel::subtract_func = NULL;
+pthread_once_t  SetKernel::select_once = PTHREAD_ONCE_INIT;
+
+
+static unsigned int intersect_scalar(const unsigned int* a, unsigned int na, const unsigned int* b, unsigned int nb, unsigned int* out) {
+  unsigned int i = 0, j = 0, n = 0;
+  while(i < na && j < nb) {
+    if(a[i] < b[j])      i++;
+    else if(a[i] > b[j]) j++;
+    else                 out[n++] = a[i++], j++;
+  }
+  return n;
+}
+
+
+static unsigned int unite_scalar(const unsigned int* a, unsigned int na, const unsigned int* b, unsigned int nb, unsigned int* out) {
+  unsigned int i = 0, j = 0, n = 0;
+  while(i < na && j < nb) {
+    if(a[i] < b[j])      out[n++] = a[i++];
+    else if(a[i] > b[j]) out[n++] = b[j++];
+    else                 out[n++] = a[i++], j++;
+  }
+  while(i < na) out[n++] = a[i++];
+  while(j < nb) out[n++] = b[j++];
+  return n;
+}
+
+
+#ifdef SET_KERNEL_SIMD
+// a is the smaller set. b is skipped by blocks while the last of the block
+// is smaller than a[i], then a[i] is compared with the whole block at once.
+__attribute__((target("sse2")))
+static unsigned int intersect_sse2(const unsigned int* a, unsigned int na, const unsigned int* b, unsigned int nb, unsigned int* out) {
+  if(na > nb) return intersect_sse2(b, nb, a, na, out);
+
+  unsigned int i = 0, j = 0, n = 0;
+  while(i < na && j+4 <= nb) {
+    if(b[j+3] < a[i]) {
+      j += 4;
+      continue;
+    }
+    __m128i v   = _mm_set1_epi32((int)a[i]);
+    __m128i blk = _mm_loadu_si128((const __m128i*)(b+j));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi32(v, blk))) out[n++] = a[i];
+    i++;
+  }
+  return n + intersect_scalar(a+i, na-i, b+j, nb-j, out+n);
+}
+
+
+__attribute__((target("avx2")))
+static unsigned int intersect_avx2(const unsigned int* a, unsigned int na, const unsigned int* b, unsigned int nb, unsigned int* out) {
+  if(na > nb) return intersect_avx2(b, nb, a, na, out);
+
+  unsigned int i = 0, j = 0, n = 0;
+  while(i < na && j+8 <= nb) {
+    if(b[j+7] < a[i]) {
+      j += 8;
+      continue;
+    }
+    __m256i v   = _mm256_set1_epi32((int)a[i]);
+    __m256i blk = _mm256_loadu_si256((const __m256i*)(b+j));
+    if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(v, blk))) out[n++] = a[i];
+    i++;
+  }
+  return n + intersect_scalar(a+i, na-i, b+j, nb-j, out+n);
+}
+
+
+// a[i] is kept unless the block of b found as in intersect_sse2 has it
+__attribute__((target("sse2")))
+static unsigned int subtract_sse2(const unsigned int* a, unsigned int na, const unsigned int* b, unsigned int nb, unsigned int* out) {
+  unsigned int i = 0, j = 0, n = 0;
+  while(i < na && j+4 <= nb) {
+    if(b[j+3] < a[i]) {
+      j += 4;
+      continue;
+    }
+    __m128i v   = _mm_set1_epi32((int)a[i]);
+    __m128i blk = _mm_loadu_si128((const __m128i*)(b+j));
+    if(!_mm_movemask_epi8(_mm_cmpeq_epi32(v, blk))) out[n++] = a[i];
+    i++;
+  }
+  return n + subtract_scalar(a+i, na-i, b+j, nb-j, out+n);
+}
+
+
+__attribute__((target("avx2")))
+static unsigned int subtract_avx2(const unsigned int* a, unsigned int na, const unsigned int* b, unsigned int nb, unsigned int* out) {
+  unsigned int i = 0, j = 0, n = 0;
+  while(i < na && j+8 <= nb) {
+    if(b[j+7] < a[i]) {
+      j += 8;
+      continue;
+    }
+    __m256i v   = _mm256_set1_epi32((int)a[i]);
+    __m256i blk = _mm256_loadu_si256((const __m256i*)(b+j));
+    if(!_mm256_movemask_epi8(_mm256_cmpeq_epi32(v, blk))) out[n++] = a[i];
+    i++;
+  }
+  return n + subtract_scalar(a+i, na-i, b+j, nb-j, out+n);
+}
+
+
+// runs of one side before the head of the other side are copied by blocks
+__attribute__((target("sse2")))
+static unsigned int unite_sse2(const unsigned int* a, unsigned int na, const unsigned int* b, unsigned int nb, unsigned int* out) {
+  unsigned int i = 0, j = 0, n = 0;
+  while(i < na && j < nb) {
+    if(j+4 <= nb && b[j+3] < a[i]) {
+      _mm_storeu_si128((__m128i*)(out+n), _mm_loadu_si128((const __m128i*)(b+j)));
+      j += 4, n += 4;
+    } else if(i+4 <= na && a[i+3] < b[j]) {
+      _mm_storeu_si128((__m128i*)(out+n), _mm_loadu_si128((const __m128i*)(a+i)));
+      i += 4, n += 4;
+    } else if(a[i] < b[j]) {
+      out[n++] = a[i++];
+    } else if(a[i] > b[j]) {
+      out[n++] = b[j++];
+    } else {
+      out[n++] = a[i++], j++;
+    }
+  }
+  return n + unite_scalar(a+i, na-i, b+j, nb-j, out+n);
+}
+
+
+__attribute__((target("avx2")))
+static unsigned int unite_avx2(const unsigned int* a, unsigned int na, const unsigned int* b, unsigned int nb, unsigned int* out) {
+  unsigned int i = 0, j = 0, n = 0;
+  while(i < na && j < nb) {
+    if(j+8 <= nb && b[j+7] < a[i]) {
+      _mm256_storeu_si256((__m256i*)(out+n), _mm256_loadu_si256((const __m256i*)(b+j)));
+      j += 8, n += 8;
+    } else if(i+8 <= na && a[i+7] < b[j]) {
+      _mm256_storeu_si256((__m256i*)(out+n), _mm256_loadu_si256((const __m256i*)(a+i)));
+      i += 8, n += 8;
+    } else if(a[i] < b[j]) {
+      out[n++] = a[i++];
+    } else if(a[i] > b[j]) {
+      out[n++] = b[j++];
+    } else {
+      out[n++] = a[i++], j++;
+    }
+  }
+  return n + unite_scalar(a+i, na-i, b+j, nb-j, out+n);
+}
+#endif
+
+
+void SetKernel::select_kernel() {
+  int k = SET_KERNEL_SCALAR;
+#ifdef SET_KERNEL_SIMD
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))      k = SET_KERNEL_AVX2;
+  else if(__builtin_cpu_supports("sse2")) k = SET_KERNEL_SSE2;
+#endif
+  set_kernel(k);
+}
+
+
+// kernels not supported by the build fall back to the scalar ones
+void SetKernel::set_kernel(int k) {
+  kernel = SET_KERNEL_SCALAR;
+  intersect_func = intersect_scalar;
+  unite_func     = unite_scalar;
+  subtract_func  = subtract_scalar;
+#ifdef SET_KERNEL_SIMD
+  if(k == SET_KERNEL_SSE2) {
+    kernel = k;
+    intersect_func = intersect_sse2;
+    unite_func     = unite_sse2;
+    subtract_func  = subtract_sse2;
+  } else if(k == SET_KERNEL_AVX2) {
+    kernel = k;
+    intersect_func = intersect_avx2;
+    unite_func     = unite_avx2;
+    subtract_func  = subtract_avx2;
+  }
+#endif
+}
+
+
+int SetKernel::get_kernel() {
+  pthread_once(&select_once, select_kernel);
+  return kernel;
+}
+
+
+unsigned int SetKernel::intersect(const unsigned int* a, unsigned int na, const unsigned int* b, unsigned int nb, unsigned int* out) {
+  pthread_once(&select_once, select_kernel);
+  return intersect_func(a, na, b, nb, out);
+}
+
+
+unsigned int SetKernel::unite(const unsigned int* a, unsigned int na, const unsigned int* b, unsigned int nb, unsigned int* out) {
+  pthread_once(&select_once, select_kernel);
+  return unite_func(a, na, b, nb, out);
+}
+
+
+unsigned int SetKernel::subtract(const unsigned int* a, unsigned int na, const unsigned int* b, unsigned int nb, unsigned int* out) {
+  pthread_once(&select_once, select_kernel);
+  return subtract_func(a, na, b, nb, out);
+}
+
+
+
+////////////////////////////////////////////////////////////////////
+//  for debug
+////////////////////////////////////////////////////////////////////
+bool SetKernel::test() {
+  int selected = get_kernel();
+  std::cout << "selected kernel: " << selected << "\n";
+
+  srand(1);
+  for(int k=SET_KERNEL_SCALAR; k<=SET_KERNEL_AVX2; k++) {
+#ifdef SET_KERNEL_SIMD
+    if(k == SET_KERNEL_AVX2 && !__builtin_cpu_supports("avx2")) continue;
+#endif
+    set_kernel(k);
+    std::cout << "kernel " << kernel << " test\n";
+
+    for(int round=0; round<200; round++) {
+      std::vector<unsigned int> a, b;
+      unsigned int range = 10 + rand() % 5000;
+      unsigned int na = rand() % 300, nb = rand() % 3000;
+      if(round % 10 == 0) range = 0xFFFFFFFF;  // unsigned order
+      for(unsigned int i=0; i<na; i++) a.push_back(rand() % range + (round % 10 == 0 ? 0x80000000 * (i & 1) : 0));
+      for(unsigned int i=0; i<nb; i++) b.push_back(rand() % range + (round % 10 == 0 ? 0x80000000 * (i & 1) : 0));
+      std::sort(a.begin(), a.end());
+      std::sort(b.begin(), b.end());
+      a.erase(std::unique(a.begin(), a.end()), a.end());
+      b.erase(std::unique(b.begin(), b.end()), b.end());
+
+      std::vector<unsigned int> expect, result(a.size() + b.size() + 1);
+      std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expect));
+      unsigned int n = intersect(a.size() ? &a[0] : NULL, a.size(), b.size() ? &b[0] : NULL, b.size(), &result[0]);
+      if(n != expect.size() || !std::equal(expect.begin(), expect.end(), result.begin())) return false;
+
+      expect.clear();
+      std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expect));
+      n = unite(a.size() ? &a[0] : NULL, a.size(), b.size() ? &b[0] : NULL, b.size(), &result[0]);
+      if(n != expect.size() || !std::equal(expect.begin(), expect.end(), result.begin())) return false;
+
+      expect.clear();
+      std::set_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expect));
+      n = subtract(a.size() ? &a[0] : NULL, a.size(), b.size() ? &b[0] : NULL, b.size(), &result[0]);
+      if(n != expect.size() || !std::equal(expect.begin(), expect.end(), result.begin())) return false;
+
+      expect.clear();
+      std::set_difference(b.begin(), b.end(), a.begin(), a.end(), std::back_inserter(expect));
+      n = subtract(b.size() ? &b[0] : NULL, b.size(), a.size() ? &a[0] : NULL, a.size(), &result[0]);
+      if(n != expect.size() || !std::equal(expect.begin(), expect.end(), result.begin())) return false;
+    }
+  }
+
+  set_kernel(selected);
+  return true;
+}
@@ -0,0 +1,50 @@
+/*****************************************************************
+ *  set_kernel.h(class SetKernel)
+ *    brief:
+ *     intersection, union and difference of sorted unique 32-bit
+ *     arrays.
+ *     SSE2/AVX2 versions are selected at run time when the CPU
+ *     supports them, with a scalar version for the others.
+ *
+ *****************************************************************/
+
+#ifndef __SET_KERNEL_H__
+#define __SET_KERNEL_H__
+
+#include <pthread.h>
+
+#include "common.h"
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SET_KERNEL_SIMD
+#endif
+
+#define SET_KERNEL_SCALAR 0
+#define SET_KERNEL_SSE2   1
+#define SET_KERNEL_AVX2   2
+
+typedef unsigned int (*SET_KERNEL_FUNC)(const unsigned int*, unsigned int, const unsigned int*, unsigned int, unsigned int*);
+
+class SetKernel {
+  public:
+    // the output needs min(na, nb) / na+nb / na elements, subtract may write over a
+    static unsigned int intersect(const unsigned int*, unsigned int, const unsigned int*, unsigned int, unsigned int*);
+    static unsigned int unite(const unsigned int*, unsigned int, const unsigned int*, unsigned int, unsigned int*);
+    static unsigned int subtract(const unsigned int*, unsigned int, const unsigned int*, unsigned int, unsigned int*);
+
+    static int  get_kernel();
+    static void set_kernel(int);
+    bool test();
+
+  private:
+    static int             kernel;
+    static SET_KERNEL_FUNC intersect_func;
+    static SET_KERNEL_FUNC unite_func;
+    static SET_KERNEL_FUNC subtract_func;
+    static pthread_once_t  select_once;
+
+    static void select_kernel();
+};
+
+#endif
@@ -10,9 +10,37 @@
  *      5. new:  create memory block from pointer(overwrited block is saved to file)
  ****************************************************************/
 
+#include <sched.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <errno.h>
+#include <vector>
+#include <algorithm>
+
 #include "shared_memory_access.h"
 #include "exception.h"
 
+
+// test-and-set spinlock on the shared memory, valid between processes
+template<class T> static inline void spin_lock(volatile T* l) {
+  unsigned int loop = 0;
+  while(__sync_lock_test_and_set(l, 1)) {
+    while(*l) {
+      if(++loop % MAX_SPIN_LOOP == 0) sched_yield();
+    }
+  }
+}
+
+template<class T> static inline bool spin_trylock(volatile T* l) {
+  return __sync_lock_test_and_set(l, 1) == 0;
+}
+
+template<class T> static inline void spin_unlock(volatile T* l) {
+  __sync_lock_release(l);
+}
+
+
 SharedMemoryAccess::SharedMemoryAccess() {
   unit_size = getpagesize();
   block_size = 1;
@@ -23,11 +51,17 @@ SharedMemoryAccess::SharedMemoryAccess() {
   shm_header = NULL;
   shm_block = NULL;
   shm_data = NULL;
+  shm_lock = NULL;
 
   c1 = c2 = c3 = 0;
   x1 = x2 = 0;
+  clock_hand = 0;
+  clear_stats();
 
-  srand(time(NULL));
+  flusher_running = false;
+  flush_interval = 0;
+  pthread_mutex_init(&flusher_mutex, NULL);
+  pthread_cond_init(&flusher_cond, NULL);
 }
 
 SharedMemoryAccess::SharedMemoryAccess(unsigned int _unit_size, unsigned int _block_size) {
@@ -40,17 +74,25 @@ SharedMemoryAccess::SharedMemoryAccess(unsigned int _unit_size, unsigned int _bl
   shm_header = NULL;
   shm_block = NULL;
   shm_data = NULL;
+  shm_lock = NULL;
 
   c1 = c2 = c3 = 0;
   x1 = x2 = 0;
+  clock_hand = 0;
+  clear_stats();
 
-  srand(time(NULL));
+  flusher_running = false;
+  flush_interval = 0;
+  pthread_mutex_init(&flusher_mutex, NULL);
+  pthread_cond_init(&flusher_cond, NULL);
 }
 
 
 SharedMemoryAccess::~SharedMemoryAccess() {
   release();
   delete shm_file;
+  pthread_cond_destroy(&flusher_cond);
+  pthread_mutex_destroy(&flusher_mutex);
 }
 
 
@@ -81,11 +123,16 @@ bool SharedMemoryAccess::init(unsigned int _unit_size, unsigned int _block_size)
   return init();
 }
 
+unsigned int SharedMemoryAccess::get_allocate_size() {
+  return sizeof(SharedMemoryHeader) + sizeof(SharedMemoryBlock)*block_size + 
+         sizeof(int)*block_size + unit_size*block_size + sizeof(int)*SHM_LOCK_STRIPE;
+}
+
+
 bool SharedMemoryAccess::init() {
   if(shm != NULL) release(); // discard old data
 
-  unsigned int allocate_size = sizeof(SharedMemoryHeader) + sizeof(SharedMemoryBlock)*block_size + 
-                               sizeof(int)*block_size + unit_size*block_size;
+  unsigned int allocate_size = get_allocate_size();
 
   // allocate
   shm_file->remove_with_suffix();
@@ -104,6 +151,7 @@ bool SharedMemoryAccess::init() {
   for(unsigned int i=0; i<block_size; i++) { 
     shm_block[i].sector = 0, shm_block[i].val = 0, shm_block[i].next = -1, shm_block[i].refer = 0;
     shm_block[i].update_flag = false, shm_block[i].lock_flag = false, shm_block[i].generation = 0;
+    shm_block[i].usage = 0;
   }
 
   shm_hash_table = (int*)(shm_block+block_size);
@@ -111,6 +159,9 @@ bool SharedMemoryAccess::init() {
 
   shm_data   = (char*)(shm_hash_table + block_size);
   memset(shm_data, 0, (unit_size * block_size));
+
+  shm_lock   = (volatile int*)(shm_data + unit_size*block_size);
+  for(unsigned int i=0; i<SHM_LOCK_STRIPE; i++) shm_lock[i] = 0;
   return true;
 
 allocate_error:
@@ -129,10 +180,18 @@ bool SharedMemoryAccess::setup(unsigned int _unit_size, unsigned int _block_size
 bool SharedMemoryAccess::setup() {
   if(shm != NULL) release(); // discard old data
 
-  unsigned int allocate_size = sizeof(SharedMemoryHeader) + sizeof(SharedMemoryBlock)*block_size + 
-                               sizeof(int)*block_size + unit_size*block_size;
+  unsigned int allocate_size = get_allocate_size();
+  struct stat st;
+  FileHandler h;
+  PageInfo first_page = {0, 0, PAGE_READWRITE, DATA_TYPE_DEFAULT};
 
   shm_file->set_page_size(allocate_size);
+
+  // files made before bucket locks were added are shorter
+  h = shm_file->get_handler(first_page);
+  if(h.fd == -1 || fstat(h.fd, &st) == -1 || st.st_size == 0) goto allocate_error;
+  if((unsigned int)st.st_size < shm_file->get_page_size() && ftruncate(h.fd, shm_file->get_page_size()) == -1) goto allocate_error;
+
   shm = shm_file->load_page(0, 0, PAGE_READWRITE);
   if(!shm) goto allocate_error;
 
@@ -145,6 +204,8 @@ bool SharedMemoryAccess::setup() {
   }
   shm_hash_table = (int*)(shm_block+block_size);
   shm_data   = (char*)(shm_hash_table + block_size);
+  shm_lock   = (volatile int*)(shm_data + unit_size*block_size);
+  for(unsigned int i=0; i<SHM_LOCK_STRIPE; i++) shm_lock[i] = 0;
   unlock_all();
   return true;
 
@@ -155,12 +216,14 @@ allocate_error:
 
 
 bool SharedMemoryAccess::release() {
+  stop_flusher();
   shm_file->clear_page();
 
   shm = NULL;
   shm_header = NULL;
   shm_block = NULL;
   shm_data = NULL;
+  shm_lock = NULL;
 
   return true;
 }
@@ -171,67 +234,116 @@ void* SharedMemoryAccess::new_unit(const void* src, struct PageInfo& info, unsig
   int block = -1;
 
   void* ptr = load_unit(info);
-
-  // page not exists
-  if(!internal_lock()) return NULL;
-
   if(ptr) {  // page already exists
     if(info.mode == PAGE_READWRITE) {
       memset(ptr, 0, unit_size);
       if(src) memcpy(ptr, src, src_size);
     }
-    internal_unlock();
     return ptr;
   }
 
+  unsigned int stripe = hash_lock(info);
+  if(find_hash_list(info) != -1) {  // loaded by other thread meanwhile
+    hash_unlock(stripe);
+    return new_unit(src, info, src_size);
+  }
+
+  block = allocate_block(info, stripe);
+  if(block == -1) {
+    hash_unlock(stripe);
+    return NULL;
+  }
+
+  memset(shm_data+unit_size*block, 0, unit_size);
+  if(src) memcpy(shm_data+unit_size*block, src, src_size);
+
+  hash_unlock(stripe);
+  return shm_data+unit_size*block;
+}
+
+
+// load the page from file directly into the block on a cache miss.
+// the block is page locked while reading, other threads wait in load_unit.
+void* SharedMemoryAccess::read_unit(FileAccess* file, struct PageInfo& info) {
+  void* ptr = load_unit(info);
+  if(ptr) return ptr;
+
+  unsigned int stripe = hash_lock(info);
+  if(find_hash_list(info) != -1) {  // loaded by other thread meanwhile
+    hash_unlock(stripe);
+    return read_unit(file, info);
+  }
+
+  int block = allocate_block(info, stripe);
+  if(block == -1) {
+    hash_unlock(stripe);
+    return NULL;
+  }
+  bool page_lock = shm_block[block].lock_flag;
+  shm_block[block].lock_flag = true;
+  hash_unlock(stripe);
+
+  bool result = file->read_page(shm_data+unit_size*block, unit_size);
+
+  stripe = hash_lock(info);
+  if(result) {
+    shm_block[block].lock_flag = page_lock;
+  } else {  // unlinked block is reused by find_victim
+    remove_hash_list(info, block);
+    shm_block[block].lock_flag = false;
+    shm_block[block].update_flag = false;
+    shm_block[block].refer = 0;
+    shm_block[block].usage = 0;
+  }
+  hash_unlock(stripe);
+
+  return result ? shm_data+unit_size*block : NULL;
+}
+
+
+// take an empty block or a victim and link it to the page.
+// caller holds the bucket lock [stripe]
+// lock order: page bucket -> internal -> victim bucket(try only)
+int SharedMemoryAccess::allocate_block(struct PageInfo& info, unsigned int stripe) {
+  int block = -1;
+
+  struct timeval wait_start;
+  gettimeofday(&wait_start, NULL);
+  if(!internal_lock()) return -1;
+  add_lock_wait(info.type, wait_start);
+
   if(shm_header->empty_block > 0) {
     block = block_size - shm_header->empty_block;
     shm_header->empty_block--;
   } else {
-    unsigned int i=0;
-    for(;;) {
-      int tmp_block = ((unsigned int)((rand() << 16) | (rand() & 0x0000FFFF))) % block_size;
-      if(shm_block[tmp_block].lock_flag || shm_block[tmp_block].refer != 0) continue;
-
-      if(i==0 || abs(shm_header->generation-shm_block[tmp_block].generation) > abs(shm_header->generation-shm_block[block].generation)) {
-        block = tmp_block;
-      }
-      i++;
-      if(i>20) break;
-    }
-
-    if(!write_unit(block))  {
+    block = find_victim(stripe);
+    if(block == -1) {
       internal_unlock();
-      return NULL;
+      return -1;
     }
-
-    PageInfo remove_page_info = {shm_block[block].sector, VAL_TO_FILE_PAGE(shm_block[block].val), PAGE_READWRITE, 
-                                 VAL_TO_FILE_TYPE(shm_block[block].val)};
-    remove_hash_list(remove_page_info, block);
   }
 
-  //std::cout << "====\n";
-  //dump_block(block);
   add_hash_list(info, block);
   shm_block[block].update_flag = (info.mode == PAGE_READWRITE ? true : false);
   shm_block[block].lock_flag = (info.mode == PAGE_READWRITE ? true : false);
   shm_block[block].refer = 1;
   shm_block[block].generation = shm_header->generation;
-  memset(shm_data+unit_size*block, 0, unit_size);
-  if(src) memcpy(shm_data+unit_size*block, src, src_size);
-  //dump_block(block);
-  //std::cout << "----\n";
-
+  shm_block[block].usage = 0;
+  touch_block(block);
   internal_unlock();
-  return shm_data+unit_size*block;
+  __sync_fetch_and_add(&type_stats(info.type).miss, 1);
+
+  return block;
 }
 
 
 void* SharedMemoryAccess::load_unit(struct PageInfo& info) {
   int block = -1;
   int loop_cnt = 0;
+  unsigned int stripe = 0;
+  struct timeval wait_start;
   while(1) {
-    if(!internal_lock()) return NULL;
+    stripe = hash_lock(info);
     block = find_hash_list(info);
     if(block == -1) break;
     if(!shm_block[block].lock_flag) {
@@ -241,24 +353,29 @@ void* SharedMemoryAccess::load_unit(struct PageInfo& info) {
       }
       shm_block[block].refer++;
       shm_block[block].generation = shm_header->generation;
+      touch_block(block);
+      __sync_fetch_and_add(&type_stats(info.type).hit, 1);
+      if(loop_cnt > 0) add_lock_wait(info.type, wait_start);
       break;
     }
-    internal_unlock();
+    hash_unlock(stripe);
 
+    if(loop_cnt == 0) gettimeofday(&wait_start, NULL);
     usleep(SBM_WAIT_DURATION); // wait page lock
     loop_cnt ++;
     if(info.mode == PAGE_READONLY && loop_cnt > MAX_LOCK_LOOP) {
+      add_lock_wait(info.type, wait_start);
       return NULL;
     } 
   }
 
-  internal_unlock();
+  hash_unlock(stripe);
   return (block == -1) ? NULL : (shm_data + unit_size*block);
 }
 
 
 bool SharedMemoryAccess::save_unit(struct PageInfo& info) {
-  if(!internal_lock()) return false;
+  unsigned int stripe = hash_lock(info);
 
   int block = find_hash_list(info);
   if(block != -1) {
@@ -266,14 +383,14 @@ bool SharedMemoryAccess::save_unit(struct PageInfo& info) {
     shm_block[block].lock_flag = false;
     if(shm_block[block].refer > 0) shm_block[block].refer--;
   }
-  internal_unlock(); 
+  hash_unlock(stripe); 
 
   return (block == -1) ? false : true;
 }
 
 
 bool SharedMemoryAccess::remove_unit(struct PageInfo& info) {
-  if(!internal_lock()) return false;
+  unsigned int stripe = hash_lock(info);
 
   int block = find_hash_list(info);
   if(block != -1) {
@@ -284,14 +401,14 @@ bool SharedMemoryAccess::remove_unit(struct PageInfo& info) {
     shm_block[block].generation = 0;
   }
 
-  internal_unlock();
+  hash_unlock(stripe);
   return (block == -1) ? false : true;
 }
 
 
 
 bool SharedMemoryAccess::lock(struct PageInfo& info) {
-  if(!internal_lock()) return false;
+  unsigned int stripe = hash_lock(info);
  
   int block = find_hash_list(info);
   if(block != -1) {
@@ -300,12 +417,12 @@ bool SharedMemoryAccess::lock(struct PageInfo& info) {
   }
   
 
-  internal_unlock();
+  hash_unlock(stripe);
   return (block == -1) ? false : true;
 }
 
 bool SharedMemoryAccess::unlock(struct PageInfo& info) {
-  if(!internal_lock()) return false;
+  unsigned int stripe = hash_lock(info);
 
   int block = find_hash_list(info);
   if(block != -1) {
@@ -313,7 +430,7 @@ bool SharedMemoryAccess::unlock(struct PageInfo& info) {
     if(shm_block[block].refer > 0) shm_block[block].refer--;
   }
 
-  internal_unlock();
+  hash_unlock(stripe);
   return (block == -1) ? false : true;
 }
 
@@ -322,14 +439,23 @@ bool SharedMemoryAccess::lock_all() {  // force lock
   if(!shm) return true;
 
   unsigned int wait_count = 0;
-  while(1) {
-    if(!shm_header->internal_mutex) break;
+  while(!spin_trylock(&shm_header->internal_mutex)) {
     usleep(SBM_WAIT_DURATION);
     wait_count++;
     if(wait_count > MAX_LOCK_LOOP) break;
   }
   shm_header->internal_mutex = true; 
 
+  for(unsigned int i=0; i<SHM_LOCK_STRIPE; i++) {
+    wait_count = 0;
+    while(!spin_trylock(&shm_lock[i])) {
+      usleep(SBM_WAIT_DURATION);
+      wait_count++;
+      if(wait_count > MAX_LOCK_LOOP) break;
+    }
+    shm_lock[i] = 1;
+  }
+
   for(unsigned int i=0; i<block_size; i++) {
     wait_count = 0;
     while(1) {
@@ -348,6 +474,7 @@ bool SharedMemoryAccess::lock_all() {  // force lock
 bool SharedMemoryAccess::unlock_all() { // force unlock
   if(!shm) return false;
   internal_unlock();
+  for(unsigned int i=0; i<SHM_LOCK_STRIPE; i++) spin_unlock(&shm_lock[i]);
 
   for(unsigned int i=0; i<block_size; i++) {
     shm_block[i].lock_flag = false;
@@ -420,6 +547,54 @@ bool SharedMemoryAccess::add_hash_list(struct PageInfo& info, unsigned int block
 }
 
 
+// CLOCK: sweep the blocks, a referenced block loses its usage and survives the round.
+// returns the victim removed from the hash list, or -1 if all blocks are in use.
+// caller holds internal lock and the bucket lock [stripe]
+int SharedMemoryAccess::find_victim(unsigned int stripe) {
+  unsigned int max_loop = block_size * (SHM_USAGE_MAX + 2);
+
+  for(unsigned int i=0; i<max_loop; i++) {
+    unsigned int block = clock_hand;
+    clock_hand = (clock_hand + 1) % block_size;
+
+    if(shm_block[block].lock_flag || shm_block[block].refer != 0) continue;
+    if(shm_block[block].usage > 0) {
+      shm_block[block].usage--;
+      continue;
+    }
+    if(shm_block[block].update_flag && flusher_running && i < block_size) continue;  // left to the flusher
+
+    PageInfo remove_page_info = {shm_block[block].sector, VAL_TO_FILE_PAGE(shm_block[block].val), PAGE_READWRITE, 
+                                 VAL_TO_FILE_TYPE(shm_block[block].val)};
+    unsigned int remove_stripe = (shm_block[block].val % hash_size) % SHM_LOCK_STRIPE;
+    if(remove_stripe != stripe && !spin_trylock(&shm_lock[remove_stripe])) continue;
+
+    // the victim may be taken before its bucket is locked
+    if(shm_block[block].lock_flag || shm_block[block].refer != 0 || !write_unit(block)) {
+      if(remove_stripe != stripe) spin_unlock(&shm_lock[remove_stripe]);
+      continue;
+    }
+
+    remove_hash_list(remove_page_info, block);
+    if(remove_stripe != stripe) spin_unlock(&shm_lock[remove_stripe]);
+    __sync_fetch_and_add(&type_stats(remove_page_info.type).evict, 1);
+    return block;
+  }
+
+  return -1;
+}
+
+
+// GCLOCK reference, info pages are weighted to stay longer than data pages
+void SharedMemoryAccess::touch_block(unsigned int block) {
+  unsigned int type = VAL_TO_FILE_TYPE(shm_block[block].val);
+  unsigned int weight = (type >= DATA_TYPE_DOCUMENT_INFO) ? SHM_USAGE_INFO : SHM_USAGE_DATA;
+  unsigned int usage = shm_block[block].usage + weight;
+
+  shm_block[block].usage = (usage > SHM_USAGE_MAX) ? SHM_USAGE_MAX : usage;
+}
+
+
 bool SharedMemoryAccess::write_unit(unsigned int block) {
   if(!shm_block[block].update_flag) {
     return true;
@@ -434,26 +609,182 @@ bool SharedMemoryAccess::write_unit(unsigned int block) {
   }
 
   shm_block[block].update_flag = false;
+  __sync_fetch_and_add(&type_stats(shm_block[block].val).write_back, 1);
   return true;
 }
 
 
-bool SharedMemoryAccess::internal_lock() {
-  while(shm_header->internal_mutex) {
-    usleep(SBM_WAIT_DURATION);
+// sort key of the block: file type, sector, page
+unsigned long long SharedMemoryAccess::get_block_key(unsigned int block) {
+  return ((unsigned long long)(shm_block[block].val >> 24) << 40) | 
+         ((unsigned long long)shm_block[block].sector << 24) | VAL_TO_FILE_PAGE(shm_block[block].val);
+}
+
+
+// write back the dirty blocks not locked by writers, in file/sector/page order.
+// adjacent pages are copied into one buffer and written at once.
+unsigned int SharedMemoryAccess::flush() {
+  if(!shm) return 0;
+
+  std::vector<std::pair<unsigned long long, unsigned int> > dirty;
+  for(unsigned int i=0; i<block_size-shm_header->empty_block; i++) {
+    if(shm_block[i].update_flag && !shm_block[i].lock_flag) dirty.push_back(std::make_pair(get_block_key(i), i));
   }
-  shm_header->internal_mutex = true; 
+  if(dirty.size() == 0) return 0;
+  std::sort(dirty.begin(), dirty.end());
+
+  char* buf = (char*)malloc(unit_size*SHM_FLUSH_RUN);
+  unsigned int page_carry = MAX_FILE_SIZE / unit_size;
+  unsigned int run[SHM_FLUSH_RUN];
+  unsigned int run_count = 0;
+  unsigned long long run_key = 0;
+  unsigned int written = 0;
+
+  for(unsigned int i=0; i<dirty.size(); i++) {
+    unsigned long long key = dirty[i].first;
+    bool adjacent = run_count > 0 && run_count < SHM_FLUSH_RUN && key == run_key + run_count && 
+                    (key & 0x00FFFFFF) % page_carry != 0;  // same file
+    if(!adjacent && run_count > 0) {
+      if(write_run(run_key, run, run_count, buf)) written += run_count;
+      run_count = 0;
+    }
+
+    if(!pin_dirty_block(dirty[i].second, key, buf+unit_size*run_count)) continue;
+    if(run_count == 0) run_key = key;
+    run[run_count++] = dirty[i].second;
+  }
+  if(run_count > 0 && write_run(run_key, run, run_count, buf)) written += run_count;
+
+  free(buf);
+  return written;
+}
+
+
+// copy the dirty block and mark it clean, refer keeps it from eviction until written.
+// a writer touching it meanwhile makes it dirty again.
+bool SharedMemoryAccess::pin_dirty_block(unsigned int block, unsigned long long key, void* dst) {
+  unsigned int stripe = (shm_block[block].val % hash_size) % SHM_LOCK_STRIPE;
+  spin_lock(&shm_lock[stripe]);
+
+  bool result = get_block_key(block) == key && shm_block[block].update_flag && !shm_block[block].lock_flag;
+  if(result) {
+    memcpy(dst, shm_data+unit_size*block, unit_size);
+    shm_block[block].update_flag = false;
+    shm_block[block].refer++;
+  }
+
+  spin_unlock(&shm_lock[stripe]);
+  return result;
+}
+
+
+bool SharedMemoryAccess::write_run(unsigned long long key, unsigned int* blocks, unsigned int count, void* src) {
+  unsigned int type = (unsigned int)(key >> 40) << 24;
+  FileAccess f;
+  f.set_file_name(path, type, "dat");
+  f.set_page_size(unit_size);
+  f.set_page_info((key >> 24) & 0xFFFF, key & 0x00FFFFFF, PAGE_READWRITE);
+  bool result = f.write_page(src, unit_size*count);
+
+  for(unsigned int i=0; i<count; i++) {
+    unsigned int stripe = (shm_block[blocks[i]].val % hash_size) % SHM_LOCK_STRIPE;
+    spin_lock(&shm_lock[stripe]);
+    if(shm_block[blocks[i]].refer > 0) shm_block[blocks[i]].refer--;
+    if(!result) shm_block[blocks[i]].update_flag = true;
+    spin_unlock(&shm_lock[stripe]);
+  }
+
+  if(result) __sync_fetch_and_add(&type_stats(type).write_back, count);
+  return result;
+}
+
+
+// background write back every interval(msec)
+bool SharedMemoryAccess::start_flusher(unsigned int interval) {
+  if(!shm || flusher_running || interval == 0) return false;
+
+  flush_interval = interval;
+  flusher_running = true;
+  if(pthread_create(&flusher, NULL, flusher_main, this) != 0) {
+    flusher_running = false;
+    return false;
+  }
+  return true;
+}
+
+
+void SharedMemoryAccess::stop_flusher() {
+  if(!flusher_running) return;
+
+  pthread_mutex_lock(&flusher_mutex);
+  flusher_running = false;
+  pthread_cond_signal(&flusher_cond);
+  pthread_mutex_unlock(&flusher_mutex);
+  pthread_join(flusher, NULL);
+}
+
+
+void* SharedMemoryAccess::flusher_main(void* p) {
+  SharedMemoryAccess* shm = (SharedMemoryAccess*)p;
+
+  // signals are handled by other threads, a flush is never interrupted
+  sigset_t mask;
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  pthread_mutex_lock(&shm->flusher_mutex);
+  while(shm->flusher_running) {
+    struct timeval now;
+    struct timespec timeout;
+    gettimeofday(&now, NULL);
+    unsigned long usec = now.tv_usec + (shm->flush_interval % 1000) * 1000;
+    timeout.tv_sec  = now.tv_sec + shm->flush_interval / 1000 + usec / 1000000;
+    timeout.tv_nsec = (usec % 1000000) * 1000;
+
+    int rc = pthread_cond_timedwait(&shm->flusher_cond, &shm->flusher_mutex, &timeout);
+    if(rc != ETIMEDOUT || !shm->flusher_running) continue;
 
+    pthread_mutex_unlock(&shm->flusher_mutex);
+    shm->flush();
+    pthread_mutex_lock(&shm->flusher_mutex);
+  }
+  pthread_mutex_unlock(&shm->flusher_mutex);
+
+  return NULL;
+}
+
+
+// block allocation lock
+bool SharedMemoryAccess::internal_lock() {
+  spin_lock(&shm_header->internal_mutex);
   return true;
 }
 
 
 bool SharedMemoryAccess::internal_unlock() {
-  shm_header->internal_mutex = false;
+  spin_unlock(&shm_header->internal_mutex);
   return true;  
 }
 
 
+// hash bucket lock, guards the bucket list and its blocks' flags
+unsigned int SharedMemoryAccess::hash_lock(struct PageInfo& info) {
+  unsigned int stripe = ((info.type | info.pageno) % hash_size) % SHM_LOCK_STRIPE;
+  if(spin_trylock(&shm_lock[stripe])) return stripe;
+
+  struct timeval wait_start;
+  gettimeofday(&wait_start, NULL);
+  spin_lock(&shm_lock[stripe]);
+  add_lock_wait(info.type, wait_start);
+  return stripe;
+}
+
+
+void SharedMemoryAccess::hash_unlock(unsigned int stripe) {
+  spin_unlock(&shm_lock[stripe]);
+}
+
+
 
 SharedMemoryHeader* SharedMemoryAccess::get_header() {
   return shm_header;
@@ -465,9 +796,67 @@ void SharedMemoryAccess::next_generation() {
 
 
 
+SharedMemoryStats& SharedMemoryAccess::type_stats(unsigned int type) {
+  return stats[VAL_TO_FILE_TYPE(type) >> 24];
+}
+
+void SharedMemoryAccess::add_lock_wait(unsigned int type, struct timeval& start) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  long usec = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_usec - start.tv_usec);
+  if(usec > 0) __sync_fetch_and_add(&type_stats(type).lock_wait, (unsigned long)usec);
+}
+
+// counters of the data type (DATA_TYPE_XXX)
+SharedMemoryStats SharedMemoryAccess::get_stats(unsigned int type) {
+  return type_stats(type);
+}
+
+void SharedMemoryAccess::clear_stats() {
+  memset(stats, 0, sizeof(stats));
+}
+
+unsigned int SharedMemoryAccess::get_used_blocks() {
+  if(!shm_header) return 0;
+  return block_size - shm_header->empty_block;
+}
+
+
+
 /////////////////////////////////////////////////////////////////////////
 //  for debug
 /////////////////////////////////////////////////////////////////////////
+struct SharedMemoryTestArg {
+  SharedMemoryAccess* shm;
+  unsigned int        start;
+  int                 errors;
+};
+
+// load pages concurrently with eviction, each page is filled by its pageno
+static void* shm_test_thread(void* p) {
+  SharedMemoryTestArg* arg = (SharedMemoryTestArg*)p;
+  unsigned int unit_size = arg->shm->get_page_size();
+  char* buffer = (char*)malloc(unit_size);
+
+  for(unsigned int n=0; n<3000; n++) {
+    unsigned int pageno = (arg->start + n*7) % 600;
+    char c = (char)(pageno % 250 + 1);
+    PageInfo info = {5, (int)pageno, PAGE_READONLY, DATA_TYPE_PHRASE_ADDR};
+
+    char* ptr = (char*)arg->shm->load_unit(info);
+    if(!ptr) {
+      memset(buffer, c, unit_size);
+      ptr = (char*)arg->shm->new_unit(buffer, info, unit_size);
+    }
+    if(!ptr || ptr[0] != c || ptr[unit_size-1] != c) arg->errors++;
+    arg->shm->save_unit(info);
+  }
+
+  free(buffer);
+  return NULL;
+}
+
+
 bool SharedMemoryAccess::test() {
   void* buffer = NULL; 
   void* ptr = NULL;
@@ -556,6 +945,16 @@ bool SharedMemoryAccess::test() {
     }
 */
 
+    std::cout << "statistics test...\n";
+    clear_stats();
+    info.pageno = 1, info.mode = PAGE_READONLY;
+    load_unit(info);
+    save_unit(info);
+    info.pageno = 3;
+    new_unit(buffer, info, unit_size);
+    save_unit(info);
+    if(get_stats(info.type).hit != 1 || get_stats(info.type).miss != 1) throw AppException(EX_APP_SHARED_MEMORY, "failed");
+
     std::cout << "remove data test...\n";
     memset(buffer, 'f', unit_size);
     info.secno = 3;
@@ -567,6 +966,55 @@ bool SharedMemoryAccess::test() {
     if(ptr) throw AppException(EX_APP_SHARED_MEMORY, "failed");
     save_unit(info);
 
+    std::cout << "replacement test...\n";
+    if(!init()) throw AppException(EX_APP_SHARED_MEMORY, "failed");
+    PageInfo hot = {6, 0, PAGE_READONLY, DATA_TYPE_REVERSE_INDEX_INFO};
+    memset(buffer, 'g', unit_size);
+    new_unit(buffer, hot, unit_size);
+    save_unit(hot);
+    for(unsigned int i=0; i<block_size*2; i++) {  // scan
+      info.secno = 6, info.pageno = i, info.mode = PAGE_READONLY, info.type = DATA_TYPE_REVERSE_INDEX;
+      new_unit(buffer, info, unit_size);
+      save_unit(info);
+      if(i % 50 == 0) {
+        if(!load_unit(hot)) throw AppException(EX_APP_SHARED_MEMORY, "failed");
+        save_unit(hot);
+      }
+    }
+    ptr = load_unit(hot);
+    if(!ptr || ((char*)ptr)[0] != 'g') throw AppException(EX_APP_SHARED_MEMORY, "failed");
+    save_unit(hot);
+
+    std::cout << "flush test...\n";
+    if(!init()) throw AppException(EX_APP_SHARED_MEMORY, "failed");
+    for(unsigned int i=0; i<3; i++) {
+      info.secno = 7, info.pageno = i, info.mode = PAGE_READWRITE, info.type = DATA_TYPE_REVERSE_INDEX;
+      memset(buffer, 'h'+i, unit_size);
+      new_unit(buffer, info, unit_size);
+      save_unit(info);
+    }
+    if(flush() != 3 || flush() != 0) throw AppException(EX_APP_SHARED_MEMORY, "failed");
+    FileAccess flushed;
+    flushed.set_file_name(path, DATA_TYPE_REVERSE_INDEX, "dat");
+    flushed.set_page_size(unit_size);
+    flushed.set_page_info(7, 2, PAGE_READONLY);
+    memset(buffer, 0, unit_size);
+    if(!flushed.read_page(buffer, unit_size) || ((char*)buffer)[0] != 'j') throw AppException(EX_APP_SHARED_MEMORY, "failed");
+    flushed.remove_with_suffix();
+
+    std::cout << "concurrent access test...\n";
+    if(!init()) throw AppException(EX_APP_SHARED_MEMORY, "failed");  // no dirty pages to write back
+    pthread_t th[4];
+    SharedMemoryTestArg args[4];
+    for(unsigned int i=0; i<4; i++) {
+      args[i].shm = this, args[i].start = i*150, args[i].errors = 0;
+      pthread_create(&th[i], NULL, shm_test_thread, &args[i]);
+    }
+    for(unsigned int i=0; i<4; i++) {
+      pthread_join(th[i], NULL);
+      if(args[i].errors > 0) throw AppException(EX_APP_SHARED_MEMORY, "failed");
+    }
+
 /*
     std::cout << "lock test...\n";
     info.secno = 4;
@@ -628,6 +1076,7 @@ void SharedMemoryAccess::dump_block(unsigned int i) {
   std::cout << (shm_block[i].update_flag ? "updated" : "-") << "\t";
   std::cout << (shm_block[i].lock_flag ? "locked" : "-") << "\t";
   std::cout << shm_block[i].generation << "\t";
+  std::cout << (int)shm_block[i].usage << "\t";
   std::cout << shm_block[i].refer << "\n";
 }
 
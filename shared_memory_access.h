@@ -14,11 +14,19 @@
 #include <sys/shm.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "common.h"
 #include "file_access.h"
 
 #define MAX_LOCK_LOOP 100
+#define MAX_SPIN_LOOP 100
+#define SHM_LOCK_STRIPE 1024  // hash bucket locks, placed after the data blocks
+#define SHM_USAGE_MAX   8     // CLOCK reference count limit
+#define SHM_USAGE_DATA  1     // weight of a reference to data pages
+#define SHM_USAGE_INFO  3     // weight of a reference to info(B-tree node) pages
+#define SHM_STATS_TYPE  16    // counters per data type (VAL_TO_FILE_TYPE >> 24)
+#define SHM_FLUSH_RUN   16    // max adjacent pages written at once by the flusher
 
 struct SharedMemoryHeader {
   // bool external_mutex[EXTERNAL_MUTEX_COUNT];
@@ -32,12 +40,23 @@ struct SharedMemoryHeader {
 };
 
 
+// buffer pool statistics, counted per process
+struct SharedMemoryStats {
+  unsigned long hit;
+  unsigned long miss;
+  unsigned long evict;
+  unsigned long write_back;
+  unsigned long lock_wait;  // usec
+};
+
+
 struct SharedMemoryBlock {
   unsigned short sector;
   unsigned int   val;
   int            next; // for hash
   bool           update_flag;
   bool           lock_flag;
+  unsigned char  usage; // for CLOCK replacement (uses padding)
   unsigned int   refer;
   int   generation;
 };
@@ -53,6 +72,7 @@ public:
   void* load_unit(struct PageInfo&);
   bool  save_unit(struct PageInfo&);
   void* new_unit(const void*, struct PageInfo&, unsigned int);
+  void* read_unit(class FileAccess*, struct PageInfo&);
   bool  remove_unit(struct PageInfo&);
 
   bool lock(struct PageInfo&);
@@ -61,6 +81,9 @@ public:
   bool unlock_all();
 
   bool save();
+  unsigned int flush();
+  bool start_flusher(unsigned int);
+  void stop_flusher();
   bool check();
   bool test();
   bool dump();
@@ -83,6 +106,10 @@ public:
 
   void next_generation();
 
+  SharedMemoryStats get_stats(unsigned int);
+  unsigned int      get_used_blocks();
+  void              clear_stats();
+
   clock_t c1, c2, c3;  // for benchmark
   int x1, x2, x3;
 
@@ -100,16 +127,37 @@ private:
   struct SharedMemoryBlock*   shm_block;
   int*                        shm_hash_table;
   char*                       shm_data;
+  volatile int*               shm_lock;
 
   struct SharedMemoryInfo* block_info;
+  unsigned int             clock_hand;  // per process, under internal lock
+  SharedMemoryStats        stats[SHM_STATS_TYPE];
+
+  pthread_t                flusher;
+  pthread_mutex_t          flusher_mutex;
+  pthread_cond_t           flusher_cond;
+  volatile bool            flusher_running;
+  unsigned int             flush_interval;  // msec
 
   int  find_hash_list(struct PageInfo&);
   bool remove_hash_list(struct PageInfo&, unsigned int);
   bool add_hash_list(struct PageInfo&, unsigned int);
   bool write_unit(unsigned int);
+  bool pin_dirty_block(unsigned int, unsigned long long, void*);
+  bool write_run(unsigned long long, unsigned int*, unsigned int, void*);
+  unsigned long long get_block_key(unsigned int);
+  static void* flusher_main(void*);
+  int  allocate_block(struct PageInfo&, unsigned int);
+  int  find_victim(unsigned int);
+  void touch_block(unsigned int);
 
   bool internal_lock();
   bool internal_unlock();
+  unsigned int hash_lock(struct PageInfo&);
+  void         hash_unlock(unsigned int);
+  unsigned int get_allocate_size();
+  SharedMemoryStats& type_stats(unsigned int);
+  void add_lock_wait(unsigned int, struct timeval&);
 
   void dump_block(unsigned int);
 };